@@ -0,0 +1,301 @@
+/*
+ * bench.c
+ * Fan-out latency through a relay tree (server -U, see server.c).
+ *
+ * - One publisher on the first server sends numbered lines to room "bench"
+ * - n subscribers on each listed server (origin first, then one relay per
+ *   depth, each under the one before it) join the room and time every line
+ *   from the publisher's send to their receive
+ * - Prints received/expected and p50/p90/p99/p99.9/max per server, and the
+ *   p50 added by each hop
+ * - -s spins on epoll instead of sleeping in it, so the bench's own wakeups
+ *   stay out of the numbers; use it to compare a server's -L profile with
+ *   its default (run it on cores the server does not spin on)
+ * - All subscribers are non-blocking sockets in one epoll loop; they ack
+ *   like a client would, so servers keep small windows
+ * - -w makes them spectators (F_WATCH) instead of logged-in users
+ * - Servers take only 16 connections per address unless started with -i,
+ *   and every subscriber comes from this host: start them with -i of at least
+ *   n+1 (the publisher). The bench stops before publishing if any
+ *   subscriber is refused
+ *
+ * Times are CLOCK_REALTIME on both ends: run the bench on one host, or on
+ * hosts with synced clocks.
+ *
+ * Compile:
+ *   gcc -O2 -pthread -o bench bench.c   (needs proto.h)
+ *
+ * Run:
+ *   ./bench [-n subs] [-m msgs] [-r rate] [-w] [-s] <ip:port>[,<ip:port>...]
+ *   ./bench -n 200 127.0.0.1:12345,127.0.0.1:12346,127.0.0.1:12347
+ *     (against ./server 12345 -i 1000, ./server 12346 -i 1000 -U 127.0.0.1:12345, ...)
+ *   taskset -c 0,1 ./bench -s -n 20 -m 5000 -r 500 127.0.0.1:12345   (against ./server 12345 -i 1000 -L 2,3)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proto.h"
+
+#define MAX_TARGETS 8
+#define RECV_SIZE 65536
+#define ACK_BATCH 32
+#define LOGIN_WAVE 64
+#define DRAIN_MS 2000       // how long to wait for stragglers after the last send
+#define ADMIT_MS 3000       // how long subscribers may take to hear from their server
+
+typedef struct {
+    char host[40];
+    int port;
+    uint64_t *lat;          // us, one per received line
+    size_t nlat, cap;
+} target_t;
+
+typedef struct {
+    int fd, target;
+    char buf[RECV_SIZE];
+    size_t have;
+    uint64_t rcvd, acked;   // D_MSG/D_PRIV frames, as counted for F_ACK
+    int admitted;           // 1 once the server sent anything, -1 if it hung up first
+} sub_t;
+
+target_t targets[MAX_TARGETS];
+int ntargets;
+int nsubs = 50, nmsgs = 200, rate = 10, watch, spin;
+unsigned run_id;
+
+uint64_t real_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+int dial(const char *host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &a.sin_addr) != 1) { fprintf(stderr, "bad address %s\n", host); exit(1); }
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { perror(host); exit(1); }
+    return fd;
+}
+
+// log in and join the bench room, or just watch it
+int login(int t, const char *name, int spectate) {
+    int fd = dial(targets[t].host, targets[t].port);
+    if (spectate) {
+        if (send_frame(fd, F_WATCH, 0, "bench", 5) < 0) { perror("send"); exit(1); }
+        return fd;
+    }
+    if (send_frame(fd, F_HELLO, 0, name, strlen(name)) < 0 ||
+        send_frame(fd, F_MSG, 0, "/join bench", 11) < 0) { perror("send"); exit(1); }
+    return fd;
+}
+
+void record(target_t *t, uint64_t us) {
+    if (t->nlat == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->lat = realloc(t->lat, t->cap * sizeof(uint64_t));
+        if (!t->lat) { perror("realloc"); exit(1); }
+    }
+    t->lat[t->nlat++] = us;
+}
+
+// one D_MSG payload: msg_meta_t, then "B <run> <seq> <sent_us>"
+void on_msg(sub_t *s, const char *p, size_t len) {
+    if (len <= sizeof(msg_meta_t)) return;
+    char text[64];
+    size_t n = len - sizeof(msg_meta_t);
+    if (n >= sizeof(text)) return;
+    memcpy(text, p + sizeof(msg_meta_t), n);
+    text[n] = '\0';
+    unsigned run, seq;
+    unsigned long long sent;
+    if (sscanf(text, "B %u %u %llu", &run, &seq, &sent) != 3 || run != run_id) return;
+    uint64_t now = real_us();
+    record(&targets[s->target], now > sent ? now - sent : 0);
+}
+
+// parse whatever complete frames are buffered; -1 if the server hung up
+int sub_read(sub_t *s) {
+    while (1) {
+        ssize_t r = recv(s->fd, s->buf + s->have, RECV_SIZE - s->have, 0);
+        if (r == 0) return -1;
+        if (r < 0) return errno == EAGAIN ? 0 : -1;
+        s->admitted = 1;
+        s->have += r;
+        size_t pos = 0;
+        while (s->have - pos >= sizeof(down_hdr_t)) {
+            down_hdr_t h;
+            memcpy(&h, s->buf + pos, sizeof(h));
+            uint32_t len = ntohl(h.len);
+            if (len > RECV_SIZE - sizeof(h)) return -1;
+            if (s->have - pos < sizeof(h) + len) break;
+            if (h.type == D_MSG || h.type == D_PRIV) s->rcvd++;
+            if (h.type == D_MSG) on_msg(s, s->buf + pos + sizeof(h), len);
+            pos += sizeof(h) + len;
+        }
+        memmove(s->buf, s->buf + pos, s->have - pos);
+        s->have -= pos;
+        if (!watch && s->rcvd - s->acked >= ACK_BATCH) {
+            uint8_t v[8];
+            put_be64(v, s->rcvd);
+            if (send_frame(s->fd, F_ACK, 0, v, sizeof(v)) == 0) s->acked = s->rcvd;
+        }
+    }
+}
+
+void *publisher(void *arg) {
+    (void)arg;
+    int fd = login(0, "bench_pub", 0);
+    struct timespec gap = { 0, 1000000000L / rate }, settle = { 1, 0 };
+    if (rate == 1) gap = (struct timespec){ 1, 0 };
+    nanosleep(&settle, NULL);   // let every subscriber finish joining
+    char line[64];
+    for (int i=0;i<nmsgs;i++){
+        int n = snprintf(line, sizeof(line), "B %u %d %llu", run_id, i, (unsigned long long)real_us());
+        if (send_frame(fd, F_MSG, 0, line, n) < 0) { perror("publish"); break; }
+        nanosleep(&gap, NULL);
+    }
+    // keep the publisher's own deliveries drained until main is done
+    char sink[RECV_SIZE];
+    while (recv(fd, sink, sizeof(sink), 0) > 0);
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// p in tenths of a percent
+uint64_t pct(const target_t *t, int p) {
+    if (!t->nlat) return 0;
+    size_t i = t->nlat * p / 1000;
+    return t->lat[i < t->nlat ? i : t->nlat - 1];
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n subs] [-m msgs] [-r rate] [-w] [-s] <ip:port>[,<ip:port>...]\n"
+                    "       (origin first, then one relay per depth)\n"
+                    "       servers need -i of at least subs+1: they take 16 connections per address by default\n"
+                    "  e.g. ./server 12345 -i 1000 & %s -n 200 127.0.0.1:12345\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "n:m:r:ws")) != -1) {
+        switch (c) {
+        case 'n': nsubs = atoi(optarg); break;
+        case 'm': nmsgs = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'w': watch = 1; break;
+        case 's': spin = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nsubs < 1 || nmsgs < 1 || rate < 1) usage(argv[0]);
+    for (char *tok = strtok(argv[optind], ","); tok; tok = strtok(NULL, ",")) {
+        if (ntargets == MAX_TARGETS) usage(argv[0]);
+        target_t *t = &targets[ntargets++];
+        if (sscanf(tok, "%39[^:]:%d", t->host, &t->port) != 2) usage(argv[0]);
+    }
+    if (!ntargets) usage(argv[0]);
+    run_id = getpid() ^ (unsigned)real_us();
+
+    int ep = epoll_create1(0);
+    if (ep < 0) { perror("epoll_create1"); exit(1); }
+    int total = nsubs * ntargets;
+    sub_t *subs = calloc(total, sizeof(sub_t));
+    if (!subs) { perror("calloc"); exit(1); }
+    struct timespec wave = { 0, 20 * 1000000L };
+    for (int i=0;i<total;i++){
+        char name[32];
+        sub_t *s = &subs[i];
+        s->target = i / nsubs;
+        snprintf(name, sizeof(name), "bench_%d_%d", s->target, i % nsubs);
+        s->fd = login(s->target, name, watch);
+        // in waves, so the server's handshake slots are not overrun
+        if (i % LOGIN_WAVE == LOGIN_WAVE - 1) nanosleep(&wave, NULL);
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        epoll_ctl(ep, EPOLL_CTL_ADD, s->fd, &ev);
+    }
+    // an admitted connection gets the name table at once; one over the
+    // server's per-address cap (-i) or past MAX_CLIENTS is closed instead
+    struct epoll_event evs[256];
+    uint64_t admit_by = real_us() + ADMIT_MS * 1000;
+    int waiting = total;
+    while (waiting && real_us() < admit_by) {
+        int n = epoll_wait(ep, evs, 256, 100);
+        for (int i=0;i<n;i++){
+            sub_t *s = evs[i].data.ptr;
+            if (sub_read(s) < 0) {
+                s->admitted = -1;
+                epoll_ctl(ep, EPOLL_CTL_DEL, s->fd, NULL);
+            }
+        }
+        waiting = 0;
+        for (int i=0;i<total;i++) if (!subs[i].admitted) waiting++;
+    }
+    int refused = 0;
+    for (int t=0;t<ntargets;t++){
+        int n = 0;
+        for (int i=t*nsubs;i<(t+1)*nsubs;i++) if (subs[i].admitted < 0) n++;
+        if (n) fprintf(stderr, "bench: %s:%d refused %d of %d %s\n", targets[t].host, targets[t].port, n, nsubs, watch ? "spectators" : "subscribers");
+        refused += n;
+    }
+    if (refused) {
+        fprintf(stderr, "bench: servers take 16 connections per address by default; start them with -i %d or more\n", nsubs + 1);
+        exit(1);
+    }
+    if (waiting) fprintf(stderr, "bench: %d subscriber(s) not heard from yet, going ahead\n", waiting);
+    fprintf(stderr, "bench: %d %s on %d server(s), %d msgs at %d/s\n", total, watch ? "spectators" : "subscribers", ntargets, nmsgs, rate);
+
+    pthread_t pub;
+    pthread_create(&pub, NULL, &publisher, NULL);
+    pthread_detach(pub);
+
+    // run until every line arrived everywhere, or DRAIN_MS after the last one should have been sent
+    uint64_t deadline = real_us() + 1000000 + (uint64_t)nmsgs * 1000000 / rate + DRAIN_MS * 1000;
+    size_t want = (size_t)nmsgs * nsubs;
+    while (real_us() < deadline) {
+        int done = 1;
+        for (int t=0;t<ntargets;t++) if (targets[t].nlat < want) done = 0;
+        if (done) break;
+        int n = epoll_wait(ep, evs, 256, spin ? 0 : 100);
+        for (int i=0;i<n;i++){
+            sub_t *s = evs[i].data.ptr;
+            if (sub_read(s) < 0) {
+                fprintf(stderr, "bench: %s:%d hung up\n", targets[s->target].host, targets[s->target].port);
+                epoll_ctl(ep, EPOLL_CTL_DEL, s->fd, NULL);
+            }
+        }
+    }
+
+    printf("depth  server                 received      p50      p90      p99    p99.9      max  hop p50 (us)\n");
+    uint64_t prev = 0;
+    for (int t=0;t<ntargets;t++){
+        target_t *g = &targets[t];
+        qsort(g->lat, g->nlat, sizeof(uint64_t), cmp_u64);
+        uint64_t p50 = pct(g, 500);
+        printf("%5d  %s:%-*d %4.0f%%  %8llu %8llu %8llu %8llu %8llu  %+lld\n", t, g->host, 20 - (int)strlen(g->host), g->port, 100.0 * g->nlat / want,
+               (unsigned long long)p50, (unsigned long long)pct(g, 900), (unsigned long long)pct(g, 990), (unsigned long long)pct(g, 999),
+               (unsigned long long)(g->nlat ? g->lat[g->nlat - 1] : 0), (long long)(p50 - prev));
+        prev = p50;
+    }
+    return 0;
+}
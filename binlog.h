@@ -0,0 +1,155 @@
+/*
+ * binlog.h
+ * On-disk chat log format shared by server.c (writer) and logcat.c (reader).
+ *
+ * File:   "CHATLOG1" magic, then records back to back.
+ * Record: varint body_len | body | crc32c(body), 4 bytes little-endian
+ * Bodies (first byte is the type):
+ *   BR_BASE  varint abs_ms                     starts a segment: resets the
+ *                                              clock base and both dictionaries
+ *   BR_NAME  varint id, name bytes             defines a sender id
+ *   BR_ROOM  varint id, name bytes             defines a room id
+ *   BR_MSG   varint delta_ms, varint sender, varint room, u8 flags,
+ *            [BL_PRIVATE: varint n, n x varint target], payload bytes
+ *
+ * delta_ms moves the segment's clock forward to the record's stamp; with
+ * BL_EARLIER it is how far the stamp lies behind the clock instead (stamps
+ * taken on different threads reach the log slightly out of order), and the
+ * clock stays put. Either way a record keeps the exact stamp it was sent with.
+ *
+ * Names and rooms are defined once per segment before first use, so a
+ * reader can start at any BR_BASE.
+ */
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLOG_MAGIC "CHATLOG1"
+#define BLOG_MAGIC_LEN 8
+#define BLOG_MAX_TARGETS 32
+#define BLOG_MAX_BODY (1u<<20)
+
+enum { BR_BASE = 1, BR_NAME = 2, BR_ROOM = 3, BR_MSG = 4 };
+enum { BL_NOTICE = 1, BL_PRIVATE = 2, BL_EARLIER = 4 };
+
+typedef struct {
+    int type;
+    uint64_t ts;            // absolute ms (BR_BASE and BR_MSG)
+    uint32_t id;            // BR_NAME / BR_ROOM
+    uint32_t sender, room;
+    uint32_t flags;
+    uint32_t ntargets;
+    uint32_t targets[BLOG_MAX_TARGETS];
+    const char *data;       // name or payload, not NUL-terminated
+    size_t len;
+} blog_rec_t;
+
+static uint32_t crc32c_table[256];
+
+static inline void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
+        crc32c_table[i] = c;
+    }
+}
+
+static inline uint32_t crc32c(const void *buf, size_t n) {
+    const uint8_t *p = buf;
+    uint32_t c = 0xFFFFFFFFu;
+    while (n--) c = crc32c_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static inline size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// returns bytes consumed, 0 if truncated or overlong
+static inline size_t get_varint(const uint8_t *p, size_t avail, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < avail && i < 10; i++) {
+        r |= (uint64_t)(p[i] & 0x7F) << (7*i);
+        if (!(p[i] & 0x80)) { *v = r; return i + 1; }
+    }
+    return 0;
+}
+
+// frame a body in place: out must have room for body + 14 bytes
+static inline size_t blog_frame(uint8_t *out, const uint8_t *body, size_t len) {
+    size_t n = put_varint(out, len);
+    memmove(out + n, body, len);
+    uint32_t c = crc32c(body, len);
+    out[n+len] = c; out[n+len+1] = c >> 8; out[n+len+2] = c >> 16; out[n+len+3] = c >> 24;
+    return n + len + 4;
+}
+
+/*
+ * Parse one record from p. *last_ts carries the running clock between calls.
+ * Returns bytes consumed, 0 if more input is needed, -1 if the record is
+ * corrupt (bad length, CRC mismatch or malformed body).
+ */
+static inline long blog_parse(const uint8_t *p, size_t avail, blog_rec_t *r, uint64_t *last_ts) {
+    uint64_t blen, v;
+    size_t h = get_varint(p, avail, &blen);
+    if (h == 0) return avail >= 10 ? -1 : 0;
+    if (blen == 0 || blen > BLOG_MAX_BODY) return -1;
+    if (avail < h + blen + 4) return 0;
+    const uint8_t *b = p + h, *end = b + blen;
+    const uint8_t *c = end;
+    uint32_t want = c[0] | c[1] << 8 | c[2] << 16 | (uint32_t)c[3] << 24;
+    if (crc32c(b, blen) != want) return -1;
+    size_t n;
+    r->type = *b++;
+    r->flags = r->ntargets = 0;
+    switch (r->type) {
+    case BR_BASE:
+        if (!(n = get_varint(b, end-b, &v))) return -1;
+        r->ts = *last_ts = v;
+        b += n;
+        break;
+    case BR_NAME:
+    case BR_ROOM:
+        if (!(n = get_varint(b, end-b, &v))) return -1;
+        r->id = v;
+        b += n;
+        break;
+    case BR_MSG: {
+        uint64_t delta;
+        if (!(n = get_varint(b, end-b, &delta))) return -1;
+        b += n;
+        if (!(n = get_varint(b, end-b, &v))) return -1;
+        b += n; r->sender = v;
+        if (!(n = get_varint(b, end-b, &v))) return -1;
+        b += n; r->room = v;
+        if (b >= end) return -1;
+        r->flags = *b++;
+        if (r->flags & BL_EARLIER) r->ts = *last_ts - delta;
+        else r->ts = *last_ts += delta;
+        r->flags &= ~BL_EARLIER;
+        if (r->flags & BL_PRIVATE) {
+            if (!(n = get_varint(b, end-b, &v)) || v > BLOG_MAX_TARGETS) return -1;
+            b += n;
+            r->ntargets = v;
+            for (uint32_t i = 0; i < r->ntargets; i++) {
+                if (!(n = get_varint(b, end-b, &v))) return -1;
+                b += n; r->targets[i] = v;
+            }
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+    r->data = (const char *)b;
+    r->len = end - b;
+    return h + blen + 4;
+}
+
+#endif
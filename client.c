@@ -1,43 +1,768 @@
 /*
  * client.c
- * - Connects to server
- * - Sends username first
+ * - Connects to one or more servers, each shown as a tab
+ * - Sends username first (F_HELLO frame, see proto.h)
+ * - Tags every line with a unique message id so resends can be deduplicated
+ * - Formats chat itself from structured frames: "[HH:MM] name: text",
+ *   "[HH:MM] (private) a -> b,c: text"
+ * - Acks received chat in batches (at-least-once delivery, see proto.h);
+ *   a dropped connection is redialed with backoff and the server replays
+ *   what was not acked yet, minus what we already showed; if the server
+ *   named a standby (D_STANDBY) and is unreachable, the standby is tried.
+ *   Connects are non-blocking and finish in the poll loop, so a dead host
+ *   never freezes the UI
+ * - Follows room redirects (D_REDIRECT) from a cluster: the room opens in
+ *   the tab for the node that hosts it
+ * - Joins a server's multicast group when it offers one (D_MCAST): room
+ *   messages then arrive as datagrams, gaps in their seqs are NACKed and
+ *   repaired over the TCP connection
+ * - Probes every server every 2s; RTT and one-way estimates show in the
+ *   left pane, "/stats" prints a histogram of recent RTTs
+ * - One thread, one poll() loop over the terminal and every connection;
+ *   background tabs only append to their scrollback ring, the screen is
+ *   redrawn once per loop pass
  * - ncurses UI with 3-pane layout:
- *    left: banner CARD (green)
- *    center: chat area (scrolling)
+ *    left: banner CARD (green) and latency
+ *    center: chat area (scrolling), tab bar in its top border
  *    right: user list (updated on special messages)
  *    bottom: input line with prompt [username] -->
  *
+ * Keys and commands:
+ *   F1..F9 or Ctrl-N / Ctrl-P   switch tabs
+ *   /connect <server-ip> <port> open another tab
+ *   /tab <n>, /stats, /quit
+ *
  * Compile:
- *   gcc -pthread -lncurses -o client client.c
+ *   gcc -o client client.c -lncursesw   (needs proto.h; the wide build draws UTF-8)
  *
  * Run:
- *   ./client <server-ip> <port> <username>
+ *   ./client <server-ip> <port> <username> [<server-ip>:<port> ...]
  *
  * If server is behind ngrok (tcp), use the ngrok host:port for <server-ip> <port>.
  */
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     // struct ip_mreq
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
 #include <netinet/in.h>
 #include <ncurses.h>
-#include <pthread.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "proto.h"
+
 #define BUF_SIZE 4096
 #define NAME_LEN 32
+#define MAX_USERS 1024
+#define RECV_SIZE 65536
+#define MAX_DM_TARGETS 32
+#define PROBE_MS 2000
+#define PROBE_WINDOW 128    // RTT samples kept for /stats
+#define LAT_BUCKETS 12      // <1ms, <2ms, ... <1024ms, more
+#define MAX_CONNS 9         // one per F key
+#define SCROLLBACK 1000     // lines kept per connection
+#define ACK_BATCH 32        // ack at once after this many frames...
+#define ACK_MS 200          // ...or this long after the first unacked one
+#define REDIAL_MS 1000      // first reconnect delay, doubled up to REDIAL_MAX_MS
+#define REDIAL_MAX_MS 30000
+#define CONNECT_MS 3000     // a connect still pending after this counts as failed
+#define MAX_REDIRECTS 3     // per typed line, in case nodes disagree for a moment
+#define MC_RCVBUF (1<<20)   // datagrams have no flow control: room for bursts
+#define MC_SILENCE_MS 3000  // no datagram for this long (the server sends one a second): back to TCP
+
+/*
+ * One server connection: its own name table, user list, scrollback and
+ * latency stats. Everything a tab shows lives here, so switching tabs is
+ * a pointer change and one redraw.
+ */
+typedef struct {
+    int fd;                     // -1 once disconnected
+    char host[48];
+    int port;
+    char alt_host[48];          // standby to fail over to, from D_STANDBY
+    int alt_port;
+    char label[64];             // "host:port" on the tab bar
+    char *rbuf;                 // RECV_SIZE bytes, partial frames
+    size_t have;
+    char (*names)[NAME_LEN];    // id -> username, filled from D_NAME frames
+    uint32_t nnames;
+    uint32_t users[MAX_USERS];  // members of the current room
+    int nusers;
+    char *lines[SCROLLBACK];
+    int head, nlines;
+    int unread;
+    // latency, from probe echoes (all in us). The RTT is timed on the
+    // monotonic clock; up/down compare our wall clock with the server's,
+    // so they are only as good as the clocks' sync
+    int64_t lat_rtt, lat_up, lat_down;
+    uint64_t probe_t0, probe_sent;  // last probe: its payload, mono_us when sent
+    uint32_t lat_ring[PROBE_WINDOW];
+    int lat_n, lat_head;
+    int unacked, acks;          // sent vs. D_ACKed (acks only come from -D servers)
+    // delivery: frames counted in the server's session, what we acked of
+    // them and when the next ack is due (0 = nothing pending)
+    uint64_t epoch, rcvd, acked, ack_due;
+    uint64_t skip;              // replayed frames we had already shown
+    uint32_t history;           // frames left in a D_HISTORY batch
+    uint32_t last_room, last_seq;   // newest live D_MSG, to skip it in history
+    uint64_t last_ts;
+    uint64_t redial_at, redial_ms;
+    // a connect in progress (the UI keeps running): to alt_host if dial_alt
+    int dial_fd, dial_alt;      // -1 when none
+    uint64_t dial_by;           // mono_ms deadline
+    int opened;                 // has been connected: failures back off and retry
+    int gone;                   // first connect failed: the main loop drops the tab
+    char join[64];              // room to /join once connected (redirects)
+    // multicast: our group socket, the server's stream id and, for mc_room,
+    // the newest seq seen; bit k of mc_miss set = seq mc_top-k still missing
+    int mc_fd;
+    uint32_t mc_stream;
+    int mc_room;                // -1 until D_MCBASE
+    uint32_t mc_top;
+    uint64_t mc_miss;
+    unsigned mc_got, mc_nacks;
+    int mc_on;                  // F_MCAST sent: room messages come by datagram
+    uint64_t mc_seen;           // mono_ms of our stream's last datagram
+} conn_t;
 
-int sockfd;
+conn_t *conns[MAX_CONNS];
+int nconns, cur;
 char username[NAME_LEN];
+uint64_t next_msg_id;
 
 WINDOW *win_left, *win_center, *win_right, *win_bottom;
-pthread_mutex_t ui_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// what the next render() has to redraw
+enum { DIRTY_BANNER = 1, DIRTY_CENTER = 2, DIRTY_USERS = 4, DIRTY_INPUT = 8, DIRTY_ALL = 15 };
+int dirty = DIRTY_ALL;
+
+char input[BUF_SIZE];
+int input_len;
+// a D_REDIRECT waiting for the main loop: join redir_room on that server
+char redir_host[48], redir_room[64];
+int redir_port, redirects;
+
+uint64_t real_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t mono_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// lines for a background tab are only stored; the active one is marked for redraw
+void append_line(conn_t *c, const char *s) {
+    int i = (c->head + c->nlines) % SCROLLBACK;
+    if (c->nlines == SCROLLBACK) {
+        free(c->lines[c->head]);
+        c->head = (c->head + 1) % SCROLLBACK;
+    } else {
+        c->nlines++;
+    }
+    c->lines[i] = strdup(s);
+    // a background tab is redrawn once, to mark it unread on the tab bar
+    if (c == conns[cur] || c->unread++ == 0) dirty |= DIRTY_CENTER;
+}
+
+void set_name(conn_t *c, uint32_t uid, const char *s, size_t len) {
+    if (uid >= c->nnames) {
+        uint32_t n = uid + 256;
+        void *p = realloc(c->names, (size_t)n * NAME_LEN);
+        if (!p) return;
+        c->names = p;
+        memset(c->names[c->nnames], 0, (size_t)(n - c->nnames) * NAME_LEN);
+        c->nnames = n;
+    }
+    if (len >= NAME_LEN) len = NAME_LEN-1;
+    memcpy(c->names[uid], s, len);
+    c->names[uid][len] = '\0';
+}
+
+const char *name_of(conn_t *c, uint32_t uid) {
+    return uid < c->nnames && c->names[uid][0] ? c->names[uid] : "?";
+}
+
+void user_add(conn_t *c, uint32_t uid) {
+    for (int i=0;i<c->nusers;i++) if (c->users[i] == uid) return;
+    if (c->nusers < MAX_USERS) c->users[c->nusers++] = uid;
+}
+
+void user_del(conn_t *c, uint32_t uid) {
+    for (int i=0;i<c->nusers;i++) {
+        if (c->users[i] == uid) {
+            memmove(&c->users[i], &c->users[i+1], (c->nusers-i-1) * sizeof(c->users[0]));
+            c->nusers--;
+            return;
+        }
+    }
+}
+
+uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+void update_userlist(conn_t *c, const char *p, size_t len) {
+    c->nusers = 0;
+    for (size_t i=0;i+4<=len;i+=4) user_add(c, get_u32(p+i));
+    if (c == conns[cur]) dirty |= DIRTY_USERS;
+}
+
+// ids with DELTA_LEAVE set left, others joined; applied in order
+void apply_delta(conn_t *c, const char *p, size_t len) {
+    for (size_t i=0;i+4<=len;i+=4) {
+        uint32_t v = get_u32(p+i);
+        if (v & DELTA_LEAVE) user_del(c, v & ~DELTA_LEAVE);
+        else user_add(c, v);
+    }
+    if (c == conns[cur]) dirty |= DIRTY_USERS;
+}
+
+// D_TEXT may hold several lines
+void show_text(conn_t *c, char *s) {
+    char *nl;
+    while ((nl = strchr(s, '\n'))) {
+        *nl = '\0';
+        if (*s) append_line(c, s);
+        s = nl + 1;
+    }
+    if (*s) append_line(c, s);
+}
+
+void on_probe(conn_t *c, const char *p, size_t len) {
+    if (len != 16) return;
+    uint64_t t0 = get_be64(p), srv = get_be64(p + 8);
+    // an echo of an older probe (answered after the next went out): no timing
+    if (t0 != c->probe_t0) return;
+    // a wall clock step between send and echo would skew a real-time RTT
+    c->lat_rtt = mono_us() - c->probe_sent;
+    c->lat_up = srv - t0;
+    c->lat_down = t0 + c->lat_rtt - srv;
+    c->lat_ring[(c->lat_head + c->lat_n) % PROBE_WINDOW] = c->lat_rtt;
+    if (c->lat_n < PROBE_WINDOW) c->lat_n++;
+    else c->lat_head = (c->lat_head + 1) % PROBE_WINDOW;
+    if (c == conns[cur]) dirty |= DIRTY_BANNER;
+}
+
+// histogram of the last PROBE_WINDOW round trips, into the chat pane
+void show_stats(conn_t *c) {
+    int count[LAT_BUCKETS] = { 0 }, n = c->lat_n, most = 0;
+    uint32_t lo = UINT32_MAX, hi = 0;
+    uint64_t sum = 0;
+    for (int i=0;i<n;i++) {
+        uint32_t v = c->lat_ring[(c->lat_head + i) % PROBE_WINDOW];
+        int b = 0;
+        while (b < LAT_BUCKETS-1 && v >= (1000u << b)) b++;
+        count[b]++;
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+        sum += v;
+    }
+    if (n == 0) { append_line(c, "*** no probes answered yet"); return; }
+    char line[128];
+    snprintf(line, sizeof(line), "*** rtt over %d probes: min %.1f avg %.1f max %.1f ms",
+             n, lo / 1000.0, sum / 1000.0 / n, hi / 1000.0);
+    append_line(c, line);
+    for (int b=0;b<LAT_BUCKETS;b++) if (count[b] > most) most = count[b];
+    for (int b=0;b<LAT_BUCKETS;b++) {
+        if (!count[b]) continue;
+        char bar[41];
+        int w = count[b] * 40 / most;
+        memset(bar, '#', w ? w : 1);
+        bar[w ? w : 1] = '\0';
+        if (b < LAT_BUCKETS-1) snprintf(line, sizeof(line), "  <%5u ms %-40s %d", 1u << b, bar, count[b]);
+        else snprintf(line, sizeof(line), "  >=%4u ms %-40s %d", 1u << (b-1), bar, count[b]);
+        append_line(c, line);
+    }
+}
+
+// "[HH:MM] ", recomputed only when the minute changes
+const char *stamp(uint64_t ts_ms) {
+    static time_t last = -1;
+    static char buf[16];
+    time_t t = ts_ms / 1000;
+    t -= t % 60;
+    if (t != last) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "[%H:%M] ", &tm);
+        last = t;
+    }
+    return buf;
+}
+
+void send_ack(conn_t *c) {
+    char v[8];
+    put_be64(v, c->rcvd);
+    if (c->fd >= 0 && send_frame(c->fd, F_ACK, 0, v, sizeof(v)) == 0) c->acked = c->rcvd;
+    c->ack_due = 0;
+}
+
+// ask the server to resend room seqs first..last over TCP
+void send_nack(conn_t *c, uint32_t first, uint32_t last) {
+    char p[10];
+    uint16_t room = htons(c->mc_room);
+    uint32_t a = htonl(first), b = htonl(last);
+    memcpy(p, &room, 2);
+    memcpy(p + 2, &a, 4);
+    memcpy(p + 6, &b, 4);
+    if (c->fd >= 0 && send_frame(c->fd, F_NACK, 0, p, sizeof(p)) == 0) c->mc_nacks++;
+}
+
+// the room got as far as seq (which we have, or not): NACK whatever lies between
+void mc_advance(conn_t *c, uint32_t seq, int have) {
+    uint32_t shift = seq - c->mc_top;
+    c->mc_miss = shift >= 64 ? 0 : c->mc_miss << shift;
+    for (uint32_t k = have; k < shift && k < 64; k++) c->mc_miss |= 1ull << k;
+    if (shift > (uint32_t)have) send_nack(c, c->mc_top + 1, have ? seq - 1 : seq);
+    c->mc_top = seq;
+}
+
+// a multicast or repaired room message; 0 if we have it already (or it is too old)
+int mc_accept(conn_t *c, uint32_t room, uint32_t seq) {
+    if ((int)room != c->mc_room || seq == 0) return 0;
+    if (seq > c->mc_top) {
+        mc_advance(c, seq, 1);
+        return 1;
+    }
+    uint32_t k = c->mc_top - seq;
+    if (k >= 64 || !(c->mc_miss >> k & 1)) return 0;
+    c->mc_miss &= ~(1ull << k);
+    return 1;
+}
+
+// a D_MSG/D_PRIV frame arrived; 0 if it is a replay of one already shown
+int count_frame(conn_t *c, const down_hdr_t *h, const msg_meta_t *m) {
+    uint32_t room = ntohs(h->room), seq = ntohl(m->seq);
+    if (h->flags & D_OFFSTREAM) {
+        // multicast or repair: outside the session count
+        if (h->type != D_MSG || !mc_accept(c, room, seq)) return 0;
+        if (seq == c->mc_top) { c->last_room = room; c->last_seq = seq; c->last_ts = meta_ts(m); }
+        return 1;
+    }
+    if (c->history) {
+        c->history--;
+        // history after a reconnect overlaps what we had; seq 0 came from
+        // the log (maybe another server's), so only the stamp can tell
+        if (h->type != D_MSG || room != c->last_room) return 1;
+        return seq && c->last_seq ? seq > c->last_seq : meta_ts(m) > c->last_ts;
+    }
+    c->rcvd++;
+    if (!c->ack_due) c->ack_due = mono_ms() + ACK_MS;
+    if (h->type == D_MSG) { c->last_room = room; c->last_seq = seq; c->last_ts = meta_ts(m); }
+    if (c->skip) { c->skip--; return 0; }
+    return 1;
+}
+
+void on_session(conn_t *c, const char *p, size_t len) {
+    if (len != 16) return;
+    uint64_t epoch = get_be64(p), base = get_be64(p + 8);
+    if (epoch != c->epoch) {
+        // new session (or server restart): room seqs start over too
+        c->epoch = epoch;
+        c->skip = 0;
+        c->last_seq = 0;
+    } else if (c->rcvd < base) {
+        // the server's window overflowed while we were away
+        char line[64];
+        snprintf(line, sizeof(line), "*** %llu messages lost", (unsigned long long)(base - c->rcvd));
+        append_line(c, line);
+        c->skip = 0;
+    } else {
+        c->skip = c->rcvd - base;
+    }
+    c->rcvd = c->acked = base;
+    c->redial_ms = 0;
+}
+
+// D_MCAST: join the group (once per tab); mc_read tells the server once
+// datagrams actually arrive, which joining alone does not promise
+void mc_join(conn_t *c, const char *p) {
+    if (c->mc_fd < 0) {
+        struct sockaddr_in a;
+        struct ip_mreq mreq;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        memcpy(&a.sin_addr, p, 4);
+        memcpy(&a.sin_port, p + 4, 2);
+        memcpy(&mreq.imr_multiaddr, p, 4);
+        memcpy(&mreq.imr_interface, p + 6, 4);
+        int fd = socket(AF_INET, SOCK_DGRAM, 0), one = 1, rcv = MC_RCVBUF;
+        if (fd < 0) return;
+        // every tab on the same group binds it; the stream id tells servers apart
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof(rcv));
+        if (bind(fd, (struct sockaddr*)&a, sizeof(a)) < 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            close(fd);
+            append_line(c, "*** cannot join the server's multicast group, staying on TCP");
+            return;
+        }
+        c->mc_fd = fd;
+    }
+    c->mc_stream = get_u32(p + 10);
+    c->mc_room = -1;
+    c->mc_on = 0;
+}
+
+// datagrams stopped: TCP again, with whatever we missed of the room resent
+void mc_leave(conn_t *c) {
+    char p[6];
+    uint16_t room = htons(c->mc_room < 0 ? 0xffff : c->mc_room);
+    uint32_t seq = htonl(c->mc_top);
+    memcpy(p, &room, 2);
+    memcpy(p + 2, &seq, 4);
+    if (c->fd >= 0) send_frame(c->fd, F_MCAST, 0, p, sizeof(p));
+    c->mc_on = 0;
+    append_line(c, "*** multicast went quiet, back to TCP");
+}
+
+void handle_frame(conn_t *c, const down_hdr_t *h, char *payload, size_t len) {
+    char line[BUF_SIZE + (MAX_DM_TARGETS+2)*(NAME_LEN+1) + 32];
+    msg_meta_t m;
+    size_t n;
+    if (h->type == D_MSG || h->type == D_PRIV) {
+        if (len < sizeof(m)) return;
+        memcpy(&m, payload, sizeof(m));
+        if (!count_frame(c, h, &m)) return;
+        payload += sizeof(m);
+        len -= sizeof(m);
+    }
+    switch (h->type) {
+    case D_NAME:
+        set_name(c, ntohl(h->sender), payload, len);
+        break;
+    case D_USERS:
+        update_userlist(c, payload, len);
+        break;
+    case D_DELTA:
+        apply_delta(c, payload, len);
+        break;
+    case D_MSG:
+        snprintf(line, sizeof(line), "%s%s: %.*s", stamp(meta_ts(&m)), name_of(c, ntohl(h->sender)), (int)len, payload);
+        append_line(c, line);
+        break;
+    case D_PRIV:
+        // flags = number of target ids ahead of the text
+        if (len < (size_t)h->flags * 4) return;
+        n = snprintf(line, sizeof(line), "%s(private) %s -> ", stamp(meta_ts(&m)), name_of(c, ntohl(h->sender)));
+        for (int i=0;i<h->flags && i<MAX_DM_TARGETS;i++) {
+            n += snprintf(line + n, sizeof(line) - n, "%s%s", i ? "," : "", name_of(c, get_u32(payload + 4*i)));
+        }
+        snprintf(line + n, sizeof(line) - n, ": %.*s", (int)(len - h->flags*4), payload + h->flags*4);
+        append_line(c, line);
+        break;
+    case D_TEXT:
+        payload[len] = '\0';
+        show_text(c, payload);
+        break;
+    case D_PROBE:
+        on_probe(c, payload, len);
+        break;
+    case D_SESSION:
+        on_session(c, payload, len);
+        break;
+    case D_HISTORY:
+        if (len == 4) c->history = get_u32(payload);
+        break;
+    case D_REDIRECT:
+        if (len > 6 && len - 6 < sizeof(redir_room)) {
+            struct in_addr a;
+            uint16_t port;
+            memcpy(&a, payload, 4);
+            memcpy(&port, payload + 4, 2);
+            inet_ntop(AF_INET, &a, redir_host, sizeof(redir_host));
+            redir_port = ntohs(port);
+            memcpy(redir_room, payload + 6, len - 6);
+            redir_room[len - 6] = '\0';
+        }
+        break;
+    case D_STANDBY:
+        if (len == 6) {
+            struct in_addr a;
+            uint16_t port;
+            memcpy(&a, payload, 4);
+            memcpy(&port, payload + 4, 2);
+            inet_ntop(AF_INET, &a, c->alt_host, sizeof(c->alt_host));
+            c->alt_port = ntohs(port);
+        }
+        break;
+    case D_MCAST:
+        if (len == 14) mc_join(c, payload);
+        break;
+    case D_MCBASE:
+        // over TCP: datagrams for this room continue after seq; by multicast,
+        // the room's newest seq, which may tell us we lost the last ones
+        if (len != 4) break;
+        if (!(h->flags & D_OFFSTREAM)) {
+            c->mc_room = ntohs(h->room);
+            c->mc_top = get_u32(payload);
+            c->mc_miss = 0;
+        } else if (ntohs(h->room) == c->mc_room && get_u32(payload) > c->mc_top) {
+            mc_advance(c, get_u32(payload), 0);
+        }
+        break;
+    case D_ACK:
+        // the message is on the server's disk
+        c->acks++;
+        if (c->unacked > 0) c->unacked--;
+        if (c == conns[cur]) dirty |= DIRTY_BANNER;
+        break;
+    }
+}
+
+// next reconnect attempt, backing off while they keep failing
+void schedule_redial(conn_t *c) {
+    c->redial_ms = c->redial_ms ? c->redial_ms * 2 : REDIAL_MS;
+    if (c->redial_ms > REDIAL_MAX_MS) c->redial_ms = REDIAL_MAX_MS;
+    c->redial_at = mono_ms() + c->redial_ms;
+}
+
+void conn_close(conn_t *c, const char *why) {
+    append_line(c, why);
+    close(c->fd);
+    c->fd = -1;
+    c->have = 0;
+    c->history = 0;
+    c->ack_due = 0;
+    c->mc_on = 0;       // the next session starts on TCP
+    schedule_redial(c);
+    dirty |= DIRTY_CENTER;
+}
+
+// the socket is readable: one recv, then every complete frame in the buffer
+void conn_read(conn_t *c) {
+    // the server coalesces frames (name table, room history) into big writes
+    ssize_t r = recv(c->fd, c->rbuf + c->have, RECV_SIZE-1 - c->have, 0);
+    if (r <= 0) {
+        conn_close(c, "*** disconnected from server");
+        return;
+    }
+    c->have += r;
+    size_t pos = 0;
+    while (c->have - pos >= sizeof(down_hdr_t)) {
+        down_hdr_t h;
+        memcpy(&h, c->rbuf + pos, sizeof(h));
+        size_t len = ntohl(h.len);
+        if (len > RECV_SIZE - 1 - sizeof(h)) {
+            conn_close(c, "*** protocol error: oversized frame");
+            return;
+        }
+        if (c->have - pos < sizeof(h) + len) break;
+        char *payload = c->rbuf + pos + sizeof(h);
+        // frames are parsed in place; stash the byte the terminator overwrites
+        char saved = payload[len];
+        handle_frame(c, &h, payload, len);
+        payload[len] = saved;
+        pos += sizeof(h) + len;
+    }
+    c->have -= pos;
+    memmove(c->rbuf, c->rbuf + pos, c->have);
+    if (c->fd >= 0 && c->rcvd - c->acked >= ACK_BATCH) send_ack(c);
+}
+
+// the group socket is readable: every datagram of our server's stream
+void mc_read(conn_t *c) {
+    char buf[RECV_SIZE];
+    ssize_t r;
+    while ((r = recv(c->mc_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        down_hdr_t h;
+        if ((size_t)r < 4 + sizeof(h) || get_u32(buf) != c->mc_stream) continue;
+        memcpy(&h, buf + 4, sizeof(h));
+        size_t len = ntohl(h.len);
+        if (len != r - 4 - sizeof(h) || (h.type != D_MSG && h.type != D_MCBASE)) continue;
+        c->mc_seen = mono_ms();
+        if (!c->mc_on) {
+            // the group reaches us: switch over; datagrams count from the D_MCBASE reply
+            if (c->fd < 0 || send_frame(c->fd, F_MCAST, 0, "", 0) < 0) continue;
+            c->mc_on = 1;
+            c->mc_room = -1;
+        }
+        h.flags |= D_OFFSTREAM;
+        if (h.type == D_MSG) c->mc_got++;
+        handle_frame(c, &h, buf + 4 + sizeof(h), len);
+    }
+    if (c == conns[cur]) dirty |= DIRTY_BANNER;
+}
+
+// start a non-blocking connect; dial_finish once poll() says writable
+int dial_start(const char *server_ip, int port) {
+    struct sockaddr_in serv;
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &serv.sin_addr) != 1) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&serv, sizeof(serv)) < 0 && errno != EINPROGRESS) { close(fd); return -1; }
+    return fd;
+}
+
+// the connect completed: back to blocking and send the hello; -1 (errno
+// set) if it failed
+int dial_finish(int fd) {
+    int err = 0;
+    socklen_t l = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &l) < 0) return -1;
+    if (err) { errno = err; return -1; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    // send username as first frame
+    send_frame(fd, F_HELLO, 0, username, strlen(username));
+    return 0;
+}
+
+// connected socket with the hello sent, -1 (errno set) if the connect fails;
+// blocks, so only for the first server, before the UI is up
+int dial(const char *server_ip, int port) {
+    int fd = dial_start(server_ip, port);
+    struct pollfd p = { fd, POLLOUT, 0 };
+    if (fd >= 0 && (poll(&p, 1, -1) < 0 || dial_finish(fd) < 0)) { close(fd); return -1; }
+    return fd;
+}
+
+// a tab with nothing connected yet; the main loop dials it
+conn_t *conn_new(const char *server_ip, int port) {
+    conn_t *c = calloc(1, sizeof(conn_t));
+    if (!c || !(c->rbuf = malloc(RECV_SIZE))) { free(c); return NULL; }
+    c->fd = -1;
+    c->dial_fd = -1;
+    c->mc_fd = -1;
+    c->mc_room = -1;
+    c->lat_rtt = -1;
+    snprintf(c->host, sizeof(c->host), "%s", server_ip);
+    c->port = port;
+    snprintf(c->label, sizeof(c->label), "%s:%d", server_ip, port);
+    return c;
+}
+
+void conn_free(conn_t *c) {
+    for (int i=0;i<SCROLLBACK;i++) free(c->lines[i]);
+    free(c->names);
+    free(c->rbuf);
+    free(c);
+}
+
+// no connect worked: back off and retry, or give up on a tab that never connected
+void dial_failed(conn_t *c) {
+    if (c->opened) schedule_redial(c);
+    else c->gone = 1;
+}
+
+// a dropped (or new) tab dials its server, the standby if that fails at once
+void conn_dial(conn_t *c) {
+    c->dial_alt = 0;
+    c->dial_fd = dial_start(c->host, c->port);
+    if (c->dial_fd < 0 && c->alt_port) {
+        c->dial_alt = 1;
+        c->dial_fd = dial_start(c->alt_host, c->alt_port);
+    }
+    c->dial_by = mono_ms() + CONNECT_MS;
+    if (c->dial_fd < 0) dial_failed(c);
+}
+
+// the pending connect finished or ran out of time; the server resumes our session
+void conn_dialed(conn_t *c, int timed_out) {
+    int fd = c->dial_fd;
+    c->dial_fd = -1;
+    if (timed_out || dial_finish(fd) < 0) {
+        close(fd);
+        if (!c->dial_alt && c->alt_port && (c->dial_fd = dial_start(c->alt_host, c->alt_port)) >= 0) {
+            c->dial_alt = 1;
+            c->dial_by = mono_ms() + CONNECT_MS;
+            return;
+        }
+        dial_failed(c);
+        return;
+    }
+    if (c->dial_alt) {
+        // the standby is the server now; the old one becomes the fallback
+        char host[48];
+        int port = c->port;
+        memcpy(host, c->host, sizeof(host));
+        memcpy(c->host, c->alt_host, sizeof(host));
+        c->port = c->alt_port;
+        memcpy(c->alt_host, host, sizeof(host));
+        c->alt_port = port;
+        snprintf(c->label, sizeof(c->label), "%s:%d", c->host, c->port);
+    }
+    c->fd = fd;
+    if (c->opened) append_line(c, "*** reconnected");
+    c->opened = 1;
+    if (c->join[0]) {
+        char line[72];
+        snprintf(line, sizeof(line), "/join %s", c->join);
+        c->join[0] = '\0';
+        if (++next_msg_id == 0) next_msg_id++;
+        send_frame(c->fd, F_MSG, next_msg_id, line, strlen(line));
+    }
+    dirty = DIRTY_ALL;
+}
+
+void add_conn(const char *server_ip, int port) {
+    char line[128];
+    if (nconns == MAX_CONNS) {
+        append_line(conns[cur], "*** too many connections");
+        return;
+    }
+    conn_t *c = conn_new(server_ip, port);
+    if (!c) {
+        snprintf(line, sizeof(line), "*** cannot connect to %s:%d", server_ip, port);
+        append_line(conns[cur], line);
+        return;
+    }
+    conns[nconns++] = c;
+}
+
+void switch_to(int i) {
+    if (i < 0 || i >= nconns || i == cur) return;
+    cur = i;
+    conns[cur]->unread = 0;
+    dirty = DIRTY_ALL;
+}
+
+// the room lives on another node: join it in that node's tab (opened if needed)
+void follow_redirect() {
+    char line[96];
+    int port = redir_port, i = 0;
+    redir_port = 0;
+    if (++redirects > MAX_REDIRECTS) {
+        append_line(conns[cur], "*** too many redirects");
+        return;
+    }
+    while (i < nconns && !(conns[i]->port == port && strcmp(conns[i]->host, redir_host) == 0)) i++;
+    if (i == nconns) {
+        add_conn(redir_host, port);
+        if (i == nconns) return;
+    }
+    switch_to(i);
+    // still connecting (or redialing): joined from conn_dialed
+    if (conns[i]->fd < 0) { snprintf(conns[i]->join, sizeof(conns[i]->join), "%s", redir_room); return; }
+    snprintf(line, sizeof(line), "/join %s", redir_room);
+    if (++next_msg_id == 0) next_msg_id++;
+    send_frame(conns[i]->fd, F_MSG, next_msg_id, line, strlen(line));
+}
 
 void draw_banner() {
-    int h,w; getmaxyx(win_left, h, w);
+    conn_t *c = conns[cur];
     werase(win_left);
     // draw a simple CARD with greenish text (use color pair)
     wattron(win_left, COLOR_PAIR(2) | A_BOLD);
@@ -46,60 +771,78 @@ void draw_banner() {
     mvwprintw(win_left, 3, 2, "#   CLI CHAT APP   #");
     mvwprintw(win_left, 4, 2, "####################");
     wattroff(win_left, COLOR_PAIR(2) | A_BOLD);
+    if (c->lat_rtt < 0) {
+        mvwprintw(win_left, 6, 2, "rtt  --");
+    } else {
+        mvwprintw(win_left, 6, 2, "rtt  %.1f ms", c->lat_rtt / 1000.0);
+        mvwprintw(win_left, 7, 2, "up   ~%.1f ms", c->lat_up / 1000.0);
+        mvwprintw(win_left, 8, 2, "down ~%.1f ms", c->lat_down / 1000.0);
+    }
+    if (c->acks) mvwprintw(win_left, 10, 2, "unacked %d", c->unacked);
+    if (c->mc_fd >= 0) mvwprintw(win_left, 11, 2, "mcast %u, nacks %u", c->mc_got, c->mc_nacks);
     box(win_left, 0, 0);
-    wrefresh(win_left);
+    wnoutrefresh(win_left);
 }
 
-void append_center(const char *s) {
-    pthread_mutex_lock(&ui_mutex);
-    // scroll center window
+// the active tab's newest lines, with the tab bar in the top border
+void draw_center() {
+    conn_t *c = conns[cur];
     int maxy, maxx; getmaxyx(win_center, maxy, maxx);
-    // write at bottom-2, then scroll up
-    wscrl(win_center, 1);
-    mvwprintw(win_center, maxy-2, 1, "%.*s", maxx-3, s);
+    werase(win_center);
     box(win_center, 0, 0);
-    wrefresh(win_center);
-    pthread_mutex_unlock(&ui_mutex);
+    int x = 1;
+    for (int i=0;i<nconns && x < maxx-2;i++) {
+        char tab[96];
+        snprintf(tab, sizeof(tab), " %d:%s%s%s ", i+1, conns[i]->label,
+                 conns[i]->fd < 0 ? " x" : "", conns[i]->unread ? " *" : "");
+        if (i == cur) wattron(win_center, A_REVERSE);
+        mvwprintw(win_center, 0, x, "%.*s", maxx-2-x, tab);
+        if (i == cur) wattroff(win_center, A_REVERSE);
+        x += strlen(tab);
+    }
+    int rows = maxy-2, show = c->nlines < rows ? c->nlines : rows;
+    for (int i=0;i<show;i++) {
+        const char *s = c->lines[(c->head + c->nlines - show + i) % SCROLLBACK];
+        mvwprintw(win_center, 1 + rows - show + i, 1, "%.*s", maxx-2, s);
+    }
+    wnoutrefresh(win_center);
 }
 
-void update_userlist(const char *csv) {
-    pthread_mutex_lock(&ui_mutex);
+void draw_userlist() {
+    conn_t *c = conns[cur];
+    int maxy = getmaxy(win_right);
     werase(win_right);
     box(win_right, 0, 0);
     mvwprintw(win_right, 1, 1, "Users:");
     int row = 2;
-    char tmp[BUF_SIZE]; strncpy(tmp, csv, sizeof(tmp)-1);
-    char *p = strtok(tmp, ",");
-    while (p) {
-        if (strlen(p)>0) {
-            mvwprintw(win_right, row++, 1, "%s", p);
-        }
-        p = strtok(NULL, ",");
+    for (int i=0;i<c->nusers && row < maxy-1;i++) {
+        mvwprintw(win_right, row++, 1, "%s", name_of(c, c->users[i]));
     }
-    wrefresh(win_right);
-    pthread_mutex_unlock(&ui_mutex);
+    wnoutrefresh(win_right);
 }
 
-void *recv_thread(void *arg) {
-    char buf[BUF_SIZE];
-    while (1) {
-        ssize_t r = recv(sockfd, buf, sizeof(buf)-1, 0);
-        if (r <= 0) {
-            append_center("*** disconnected from server");
-            break;
-        }
-        buf[r] = '\0';
-        // special userlist message starts with \x01USERS:
-        if (buf[0] == 0x01) {
-            if (strncmp(buf+1, "USERS:", 6) == 0) {
-                update_userlist(buf+7);
-                continue;
-            }
-        }
-        // otherwise normal message
-        append_center(buf);
-    }
-    return NULL;
+void draw_input() {
+    int maxx = getmaxx(win_bottom);
+    int room = maxx - (int)strlen(username) - 10;
+    // keep the end of a long line in view (bytes, but never mid-character)
+    int skip = input_len > room ? input_len - room : 0;
+    while (skip < input_len && (input[skip] & 0xc0) == 0x80) skip++;
+    werase(win_bottom);
+    box(win_bottom, 0, 0);
+    mvwprintw(win_bottom, 1, 1, "[%s] --> %.*s", username, input_len - skip, input + skip);
+    wnoutrefresh(win_bottom);
+}
+
+// one doupdate() per loop pass, however many frames came in
+void render() {
+    if (!dirty) return;
+    if (dirty & DIRTY_BANNER) draw_banner();
+    if (dirty & DIRTY_CENTER) draw_center();
+    if (dirty & DIRTY_USERS) draw_userlist();
+    // last, so the cursor ends up on the input line
+    draw_input();
+    doupdate();
+    dirty = 0;
 }
 
 void resize_ui() {
@@ -126,38 +869,77 @@ void resize_ui() {
     wbkgd(win_center, COLOR_PAIR(1));
     wbkgd(win_right, COLOR_PAIR(1));
     wbkgd(win_bottom, COLOR_PAIR(1));
-    draw_banner();
-    box(win_center, 0, 0);
-    box(win_right, 0, 0);
-    wrefresh(win_center);
-    wrefresh(win_right);
-    wrefresh(win_bottom);
+    keypad(win_bottom, TRUE);
+    nodelay(win_bottom, TRUE);
+    dirty = DIRTY_ALL;
+}
+
+// returns 1 on /quit
+int submit(const char *line) {
+    conn_t *c = conns[cur];
+    char host[64];
+    int port, n;
+    if (line[0] == '\0') return 0;
+    if (strcmp(line, "/quit") == 0) return 1;
+    if (strcmp(line, "/stats") == 0) { show_stats(c); return 0; }
+    if (sscanf(line, "/connect %63s %d", host, &port) == 2) { add_conn(host, port); dirty |= DIRTY_CENTER; return 0; }
+    if (sscanf(line, "/tab %d", &n) == 1) { switch_to(n-1); return 0; }
+    if (c->fd < 0) { append_line(c, "*** not connected"); return 0; }
+    redirects = 0;
+    // send to server
+    if (++next_msg_id == 0) next_msg_id++;
+    if (send_frame(c->fd, F_MSG, next_msg_id, line, strlen(line)) < 0) conn_close(c, "*** failed to send");
+    else if (line[0] != '/') c->unacked++;
+    return 0;
+}
+
+// returns 1 on /quit
+int on_key(int ch) {
+    if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+        input[input_len] = '\0';
+        input_len = 0;
+        dirty |= DIRTY_INPUT;
+        return submit(input);
+    }
+    if (ch == KEY_RESIZE) resize_ui();
+    else if (ch >= KEY_F(1) && ch <= KEY_F(MAX_CONNS)) switch_to(ch - KEY_F(1));
+    else if (ch == 14) switch_to((cur + 1) % nconns);             // Ctrl-N
+    else if (ch == 16) switch_to((cur + nconns - 1) % nconns);    // Ctrl-P
+    else if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) && input_len > 0) {
+        // a whole UTF-8 character: its continuation bytes, then the lead byte
+        while (input_len > 1 && (input[input_len-1] & 0xc0) == 0x80) input_len--;
+        input_len--;
+    }
+    // wgetch hands over a UTF-8 character byte by byte, all of them >= 0x80
+    else if (ch < 256 && (isprint(ch) || ch >= 0x80) && input_len < BUF_SIZE-1) input[input_len++] = ch;
+    dirty |= DIRTY_INPUT;
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <server-ip> <port> <username>\n", argv[0]);
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <server-ip> <port> <username> [<server-ip>:<port> ...]\n", argv[0]);
         exit(1);
     }
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
     strncpy(username, argv[3], NAME_LEN-1);
 
     // connect to server
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv;
-    serv.sin_family = AF_INET;
-    serv.sin_port = htons(port);
-    inet_pton(AF_INET, server_ip, &serv.sin_addr);
-    if (connect(sockfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+    conns[nconns++] = conn_new(argv[1], atoi(argv[2]));
+    if (!conns[0] || (conns[0]->fd = dial(argv[1], atoi(argv[2]))) < 0) {
         perror("connect");
         exit(1);
     }
+    conns[0]->opened = 1;
 
-    // send username as first message
-    send(sockfd, username, strlen(username), 0);
+    // message ids: random per-process base, then a counter (0 is "no id")
+    FILE *ur = fopen("/dev/urandom", "r");
+    if (!ur || fread(&next_msg_id, sizeof(next_msg_id), 1, ur) != 1) {
+        next_msg_id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16);
+    }
+    if (ur) fclose(ur);
 
-    // init ncurses
+    // init ncurses; the locale lets it draw UTF-8 names and text
+    setlocale(LC_ALL, "");
     initscr();
     cbreak();
     noecho();
@@ -169,35 +951,93 @@ int main(int argc, char **argv) {
     curs_set(1);
     resize_ui();
 
-    // start recv thread
-    pthread_t rtid;
-    pthread_create(&rtid, NULL, &recv_thread, NULL);
-
-    // main input loop
-    char input[BUF_SIZE];
-    while (1) {
-        // bottom input prompt
-        pthread_mutex_lock(&ui_mutex);
-        werase(win_bottom);
-        box(win_bottom, 0, 0);
-        mvwprintw(win_bottom, 1, 1, "[%s] --> ", username);
-        wrefresh(win_bottom);
-        // read input from user (use wgetnstr)
-        echo();
-        mvwgetnstr(win_bottom, 1, 6 + strlen(username) + 6, input, BUF_SIZE-1);
-        noecho();
-        pthread_mutex_unlock(&ui_mutex);
-
-        if (strcmp(input, "/quit") == 0) break;
-        // send to server
-        if (send(sockfd, input, strlen(input), 0) < 0) {
-            append_center("*** failed to send");
-            break;
+    // further servers, as "ip:port"
+    for (int i=4;i<argc;i++) {
+        char host[64];
+        int port;
+        if (sscanf(argv[i], "%63[^:]:%d", host, &port) == 2) add_conn(host, port);
+    }
+
+    // main loop: terminal, every live connection, probe, ack and redial timers
+    uint64_t next_probe = mono_ms();
+    int quit = 0;
+    while (!quit) {
+        uint64_t now = mono_ms();
+        uint64_t wake = next_probe;
+        for (int i=0;i<nconns;i++) {
+            conn_t *c = conns[i];
+            if (!c->gone) continue;
+            // never connected: drop the tab (conns[0] always was)
+            char line[96];
+            snprintf(line, sizeof(line), "*** cannot connect to %s:%d", c->host, c->port);
+            conn_free(c);
+            memmove(conns + i, conns + i + 1, (nconns - i - 1) * sizeof(conns[0]));
+            nconns--;
+            if (cur >= i && cur > 0) cur--;
+            append_line(conns[cur], line);
+            dirty = DIRTY_ALL;
+            i--;
+        }
+        for (int i=0;i<nconns;i++) {
+            conn_t *c = conns[i];
+            if (c->fd < 0 && c->dial_fd < 0 && !c->gone && now >= c->redial_at) conn_dial(c);
+            if (c->dial_fd >= 0 && now >= c->dial_by) conn_dialed(c, 1);
+            if (c->ack_due && now >= c->ack_due) send_ack(c);
+            if (c->mc_on && now - c->mc_seen >= MC_SILENCE_MS) mc_leave(c);
+            if (c->fd < 0 && c->dial_fd < 0 && c->redial_at < wake) wake = c->redial_at;
+            if (c->dial_fd >= 0 && c->dial_by < wake) wake = c->dial_by;
+            if (c->ack_due && c->ack_due < wake) wake = c->ack_due;
+            if (c->mc_on && c->mc_seen + MC_SILENCE_MS < wake) wake = c->mc_seen + MC_SILENCE_MS;
+        }
+        if (now >= next_probe) {
+            char t0[8];
+            uint64_t real = real_us(), mono = mono_us();
+            put_be64(t0, real);
+            for (int i=0;i<nconns;i++) {
+                if (conns[i]->fd < 0) continue;
+                if (send_frame(conns[i]->fd, F_PROBE, 0, t0, sizeof(t0)) < 0) {
+                    conn_close(conns[i], "*** disconnected from server");
+                    continue;
+                }
+                conns[i]->probe_t0 = real;
+                conns[i]->probe_sent = mono;
+            }
+            next_probe = now + PROBE_MS;
+        }
+        render();
+
+        struct pollfd pfd[2*MAX_CONNS + 1];
+        int owner[2*MAX_CONNS + 1], n = 0;
+        pfd[n].fd = STDIN_FILENO; pfd[n].events = POLLIN; owner[n++] = -1;
+        for (int i=0;i<nconns;i++) {
+            if (conns[i]->dial_fd >= 0) { pfd[n].fd = conns[i]->dial_fd; pfd[n].events = POLLOUT; owner[n++] = i; }
+            if (conns[i]->fd < 0) continue;
+            pfd[n].fd = conns[i]->fd; pfd[n].events = POLLIN; owner[n++] = i;
+            // group sockets after the TCP one: a NACK needs the connection
+            if (conns[i]->mc_fd < 0) continue;
+            pfd[n].fd = conns[i]->mc_fd; pfd[n].events = POLLIN; owner[n++] = i;
+        }
+        if (poll(pfd, n, wake > now ? wake - now : 0) <= 0) continue;
+        for (int i=1;i<n;i++) {
+            conn_t *c = conns[owner[i]];
+            if (!pfd[i].revents) continue;
+            if (pfd[i].fd == c->mc_fd) mc_read(c);
+            else if (pfd[i].fd == c->fd) conn_read(c);
+            else if (pfd[i].fd == c->dial_fd) conn_dialed(c, 0);
+        }
+        if (redir_port) follow_redirect();
+        if (pfd[0].revents) {
+            int ch;
+            while (!quit && (ch = wgetch(win_bottom)) != ERR) quit = on_key(ch);
         }
     }
 
     // cleanup
-    close(sockfd);
+    for (int i=0;i<nconns;i++) {
+        if (conns[i]->fd >= 0) close(conns[i]->fd);
+        if (conns[i]->dial_fd >= 0) close(conns[i]->dial_fd);
+        if (conns[i]->mc_fd >= 0) close(conns[i]->mc_fd);
+    }
     endwin();
     return 0;
 }
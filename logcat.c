@@ -0,0 +1,173 @@
+/*
+ * logcat.c
+ * Streams a chat.binlog (format in binlog.h) back to the classic text log:
+ *   [YYYY-mm-dd HH:MM:SS] name: message
+ *   [YYYY-mm-dd HH:MM:SS] #room name: message
+ *   [YYYY-mm-dd HH:MM:SS] (private) from -> to: message
+ *
+ * Reads in large chunks, formats into one output buffer and only calls
+ * localtime/strftime when the second changes.
+ *
+ * Compile:
+ *   gcc -O2 -o logcat logcat.c   (needs binlog.h)
+ *
+ * Run:
+ *   ./logcat [chat.binlog]
+ *   ./logcat -f chat.binlog      (keep following appended records)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binlog.h"
+
+#define READ_SIZE (4u<<20)
+#define OUT_SIZE (1u<<20)
+#define NAME_LEN 32
+#define ROOM_LEN 32
+
+typedef struct {
+    char (*v)[NAME_LEN];
+    uint32_t n;
+} dict_t;
+
+char out[OUT_SIZE];
+size_t out_len;
+
+void out_flush() {
+    fwrite(out, 1, out_len, stdout);
+    out_len = 0;
+}
+
+void out_put(const char *s, size_t n) {
+    if (out_len + n > OUT_SIZE) out_flush();
+    if (n > OUT_SIZE) { fwrite(s, 1, n, stdout); return; }
+    memcpy(out + out_len, s, n);
+    out_len += n;
+}
+
+void out_str(const char *s) { out_put(s, strlen(s)); }
+
+void dict_set(dict_t *d, uint32_t id, const char *s, size_t len) {
+    if (len >= NAME_LEN) len = NAME_LEN-1;
+    if (id >= d->n) {
+        uint32_t n = id + 64;
+        void *p = realloc(d->v, (size_t)n * NAME_LEN);
+        if (!p) { perror("realloc"); exit(1); }
+        d->v = p;
+        memset(d->v[d->n], 0, (size_t)(n - d->n) * NAME_LEN);
+        d->n = n;
+    }
+    memcpy(d->v[id], s, len);
+    d->v[id][len] = '\0';
+}
+
+const char *dict_get(const dict_t *d, uint32_t id) {
+    return id < d->n && d->v[id][0] ? d->v[id] : "?";
+}
+
+// "[YYYY-mm-dd HH:MM:SS] ", recomputed only when the second changes
+const char *stamp(uint64_t ms) {
+    static time_t last = -1;
+    static char buf[32];
+    time_t t = ms / 1000;
+    if (t != last) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S] ", &tm);
+        last = t;
+    }
+    return buf;
+}
+
+void print_msg(const blog_rec_t *r, const dict_t *names, const dict_t *rooms) {
+    out_str(stamp(r->ts));
+    if (r->flags & BL_PRIVATE) {
+        out_str("(private) ");
+        out_str(dict_get(names, r->sender));
+        out_str(" -> ");
+        for (uint32_t i = 0; i < r->ntargets; i++) {
+            if (i) out_put(",", 1);
+            out_str(dict_get(names, r->targets[i]));
+        }
+    } else {
+        if (r->room != 0) {
+            out_put("#", 1);
+            out_str(dict_get(rooms, r->room));
+            out_put(" ", 1);
+        }
+        out_str(dict_get(names, r->sender));
+    }
+    out_put(": ", 2);
+    out_put(r->data, r->len);
+    out_put("\n", 1);
+}
+
+int main(int argc, char **argv) {
+    int follow = 0, c;
+    while ((c = getopt(argc, argv, "f")) != -1) {
+        if (c == 'f') follow = 1;
+        else { fprintf(stderr, "Usage: %s [-f] [chat.binlog]\n", argv[0]); exit(1); }
+    }
+    const char *path = optind < argc ? argv[optind] : "chat.binlog";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror(path); exit(1); }
+    crc32c_init();
+
+    uint8_t *buf = malloc(READ_SIZE);
+    if (!buf) { perror("malloc"); exit(1); }
+    size_t have = 0, pos = 0;
+    long long off = 0;      // file offset of buf[0], for error messages
+    ssize_t r = read(fd, buf, BLOG_MAGIC_LEN);
+    if (r != BLOG_MAGIC_LEN || memcmp(buf, BLOG_MAGIC, BLOG_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a chat binlog\n", path);
+        exit(1);
+    }
+    off = BLOG_MAGIC_LEN;
+
+    dict_t names = { NULL, 0 }, rooms = { NULL, 0 };
+    uint64_t last_ts = 0;
+    while (1) {
+        blog_rec_t rec;
+        long used = blog_parse(buf + pos, have - pos, &rec, &last_ts);
+        if (used < 0) {
+            out_flush();
+            fprintf(stderr, "%s: corrupt record at offset %lld\n", path, off + (long long)pos);
+            exit(1);
+        }
+        if (used == 0) {
+            memmove(buf, buf + pos, have - pos);
+            off += pos; have -= pos; pos = 0;
+            r = read(fd, buf + have, READ_SIZE - have);
+            if (r < 0) { perror("read"); exit(1); }
+            if (r == 0) {
+                if (!follow) break;
+                out_flush();
+                fflush(stdout);
+                struct timespec ts = { 0, 200 * 1000000L };
+                nanosleep(&ts, NULL);
+            }
+            have += r;
+            continue;
+        }
+        pos += used;
+        switch (rec.type) {
+        case BR_BASE:
+            names.n = rooms.n = 0;
+            free(names.v); free(rooms.v);
+            names.v = rooms.v = NULL;
+            break;
+        case BR_NAME: dict_set(&names, rec.id, rec.data, rec.len); break;
+        case BR_ROOM: dict_set(&rooms, rec.id, rec.data, rec.len); break;
+        case BR_MSG: print_msg(&rec, &names, &rooms); break;
+        }
+    }
+    if (have > pos) fprintf(stderr, "%s: %zu bytes of truncated record at end\n", path, have - pos);
+    out_flush();
+    return 0;
+}
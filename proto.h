@@ -0,0 +1,208 @@
+/*
+ * proto.h
+ * Wire framing shared by client.c and server.c.
+ *
+ * Client -> server traffic is a stream of frames: a fixed header followed
+ * by `len` payload bytes. The first frame must be F_HELLO carrying the
+ * username; chat lines and commands travel as F_MSG. A message id is
+ * chosen by the client and reused verbatim when the same line is resent,
+ * which is what lets the server drop replays (0 means "no id").
+ * F_PROBE carries 8 opaque bytes (the client's send time) that come
+ * straight back in a D_PROBE, followed by the server's receive time in us
+ * since the epoch.
+ * F_ACK carries a u64 (big-endian): how many D_MSG/D_PRIV frames the client
+ * has received in its session so far. It is cumulative, so it can be sent
+ * in batches and a lost one costs nothing.
+ * F_REPL opens a standby server's connection instead of F_HELLO: u64 log
+ * offset it already has, u16 port it serves clients on. The reply is a
+ * u64 start offset followed by batches: u64 offset the batch ends at, then
+ * the raw log bytes up to it (none, as a heartbeat, when the log is idle).
+ * The standby writes back u64 offsets it has synced.
+ * F_PEER opens a link from another node of a cluster (u16: its port); the
+ * frames after it start with a kind byte (load report, room placement).
+ * F_RELAY (u16: its port) subscribes a relay server; it is then sent one
+ * D_RELAY per room message (flags = sender's depth below the origin) and
+ * sends its own clients' lines up as F_RELAYED. Both carry u8 len, room,
+ * u8 len, sender name, u64 ts (ignored going up), text.
+ * F_WATCH (room name) opens a receive-only spectator connection instead of
+ * F_HELLO: the server sends the D_NAME table, the room's history, then its
+ * D_MSG and D_NAME frames; nothing is numbered or acked and anything the
+ * spectator sends is ignored. One that falls a send buffer behind is
+ * disconnected.
+ * F_MCAST (empty) tells a server that sent D_MCAST that the client gets
+ * its datagrams; F_NACK (u16 room, u32 first, u32 last) asks for room seqs
+ * it missed there. F_MCAST with u16 room, u32 seq says the datagrams have
+ * stopped: back to TCP, and resend what followed seq in that room.
+ *
+ * Server -> client traffic is a stream of down_hdr_t frames. Users are
+ * referred to by interned 32-bit ids: the server sends D_NAME definitions
+ * (the whole table right after login, then each new name once) and every
+ * chat frame carries only the sender id. D_USERS is a room's member list
+ * and D_DELTA a batch of changes to it, both as arrays of ids (leaves have
+ * DELTA_LEAVE set). D_TEXT is a line the server formatted itself (notices,
+ * errors).
+ *
+ * Chat is sent structured and the client does all the formatting:
+ *   D_MSG   msg_meta_t, text                       room message
+ *   D_PRIV  msg_meta_t, flags x u32 target, text   private/group message
+ * seq counts per room (D_MSG) or across private messages (D_PRIV) since the
+ * server started, in delivery order; 0 marks a message replayed from the
+ * log. A server running with -D answers each F_MSG, once it is on disk,
+ * with D_ACK: the 8 id bytes as sent, then the message's u32 seq (0 for
+ * a resend it had already stored). ts is the server's stamp in ms since the
+ * epoch, taken once when the message arrived; the log record carries the
+ * same value.
+ *
+ * Delivery is at-least-once. Right after login the server sends D_SESSION:
+ * u64 epoch, u64 base (both big-endian). The D_MSG/D_PRIV frames that
+ * follow are numbers base, base+1, ... of that session; frames base up to
+ * whatever the client had counted are replays of ones it already has. A
+ * different epoch means a new session and the count starts over. Room
+ * history is led by D_HISTORY (u32: number of frames that follow); those
+ * frames are not counted, and after a resume some repeat room seqs the
+ * client has seen already. D_STANDBY (u32 IPv4, u16 port, network order)
+ * names a standby to reconnect to if this server goes away. D_REDIRECT
+ * (u32 IPv4, u16 port, room name) answers a /join for a room that lives on
+ * another node: join it there.
+ *
+ * A server running with -M sends D_MCAST after login: u32 group, u16 port
+ * (network order), u32 interface address (0 = any), u32 stream id. Its
+ * datagrams are that stream id followed by one down frame: a D_MSG, or a
+ * D_MCBASE heartbeat, at least one a second. A client that has received
+ * one and sent F_MCAST gets no more room D_MSG frames over TCP; instead,
+ * on each room switch, D_MCBASE (room in the header, u32 seq): datagrams
+ * for that room continue after seq. Answers to F_NACK (and to F_MCAST
+ * going back to TCP) are D_MSG frames flagged D_OFFSTREAM, not counted.
+ *
+ * Header integers are in network byte order; the id is opaque.
+ */
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define FRAME_MAX 4095
+
+enum {
+    F_HELLO = 1,
+    F_MSG = 2,
+    F_PROBE = 3,
+    F_ACK = 4,
+    F_REPL = 5,
+    F_PEER = 6,
+    F_RELAY = 7,
+    F_RELAYED = 8,
+    F_WATCH = 9,
+    F_MCAST = 10,
+    F_NACK = 11,
+};
+
+enum {
+    D_TEXT = 1,
+    D_MSG = 2,
+    D_NAME = 3,
+    D_USERS = 4,
+    D_DELTA = 5,
+    D_PRIV = 6,
+    D_PROBE = 7,
+    D_ACK = 8,
+    D_SESSION = 9,
+    D_HISTORY = 10,
+    D_STANDBY = 11,
+    D_REDIRECT = 12,
+    D_RELAY = 13,
+    D_MCAST = 14,
+    D_MCBASE = 15,
+};
+
+#define DELTA_LEAVE 0x80000000u
+#define D_OFFSTREAM 0x01    // D_MSG flag: not counted in the session (multicast repair)
+
+typedef struct __attribute__((packed)) {
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint64_t id;
+} frame_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t room;
+    uint32_t sender;
+} down_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t seq;
+    uint8_t ts[8];      // big-endian u64
+} msg_meta_t;
+
+static inline void put_be64(void *p, uint64_t v) {
+    uint8_t *b = p;
+    for (int i = 0; i < 8; i++) b[i] = v >> (56 - 8*i);
+}
+
+static inline uint64_t get_be64(const void *p) {
+    const uint8_t *b = p;
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | b[i];
+    return v;
+}
+
+static inline size_t put_msg_meta(char *p, uint32_t seq, uint64_t ts) {
+    msg_meta_t m;
+    m.seq = htonl(seq);
+    put_be64(m.ts, ts);
+    memcpy(p, &m, sizeof(m));
+    return sizeof(m);
+}
+
+static inline uint64_t meta_ts(const msg_meta_t *m) {
+    return get_be64(m->ts);
+}
+
+static inline size_t put_down_hdr(char *p, int type, int room, uint32_t sender, size_t len) {
+    down_hdr_t h = { htonl((uint32_t)len), type, 0, htons(room), htonl(sender) };
+    memcpy(p, &h, sizeof(h));
+    return sizeof(h);
+}
+
+// read exactly n bytes; 0 on success, -1 on EOF/error
+static inline int recv_full(int sock, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = recv(sock, p, n, 0);
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+// one frame, one send(): header and payload go out together
+static inline int send_frame(int sock, int type, uint64_t id, const void *payload, size_t len) {
+    char out[sizeof(frame_hdr_t) + FRAME_MAX];
+    if (len > FRAME_MAX) len = FRAME_MAX;
+    frame_hdr_t h = { htonl((uint32_t)len), type, 0, 0, id };
+    memcpy(out, &h, sizeof(h));
+    memcpy(out + sizeof(h), payload, len);
+    return send(sock, out, sizeof(h) + len, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// returns payload length (payload NUL-terminated in buf), -1 on EOF/error/oversize
+static inline ssize_t recv_frame(int sock, frame_hdr_t *h, char *buf, size_t cap) {
+    if (recv_full(sock, h, sizeof(*h)) < 0) return -1;
+    uint32_t len = ntohl(h->len);
+    if (len >= cap) return -1;
+    if (recv_full(sock, buf, len) < 0) return -1;
+    buf[len] = '\0';
+    return len;
+}
+
+#endif
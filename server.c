@@ -1,184 +1,4200 @@
 /*
  * server.c
  * Simple chat server:
- * - Accepts multiple clients (pthread per client)
+ * - Accepts multiple clients (pthread per client, started once the
+ *   username arrives; until then a connection is a slot in an epoll loop
+ *   with a deadline, capped per IP)
  * - Maintains list of clients and usernames
  * - Broadcasts public messages
- * - Routes private messages starting with "@username "
- * - Logs all messages to chat.log with timestamps
+ * - Routes private messages starting with "@username " or "@a,b,c " (group)
+ * - Sends chat as structured frames (sender id, seq, timestamp, payload);
+ *   clients do the formatting
+ * - Echoes latency probes with its own receive time
+ * - Optional live dashboard (-d) on an idle-priority thread: connections,
+ *   rates, top rooms and talkers, queue depths, fan-out latency; on a
+ *   terminal it keeps to the top lines and the console scrolls below it
+ * - Tracks heavy-hitter senders and rooms with streaming sketches and
+ *   rate-limits senders from them (console "top", dashboard)
+ * - Durable mode (-D): the log is fdatasync'ed in group commits and each
+ *   sender gets an ack (D_ACK) once its message is on disk
+ * - Relays (-U): a server can subscribe to another as one connection and
+ *   re-fan its messages out to local clients; relays stack into a tree
+ * - Spectators (F_WATCH): receive-only connections for dashboards and
+ *   lurkers; no thread, no session, no receive buffer, small kernel socket
+ *   buffers, fed from a per-room list right after the room's clients
+ * - LAN multicast (-M): room messages also go out once as a UDP datagram
+ *   to a multicast group; clients that join it stop getting them over TCP,
+ *   spot gaps by room seq and NACK them, repaired over TCP from a ring
+ * - Shards (-R): cluster nodes on one host share a port via SO_REUSEPORT;
+ *   an eBPF program steers each source address to the node hosting its
+ *   room, and a node hands a client whose room lives on a co-located
+ *   node over to that process, socket and all
+ * - Low-latency profile (-L cpus): the most recently active senders'
+ *   threads each get one of the listed cores to themselves and spin on
+ *   their socket instead of sleeping in recv; every other thread is kept
+ *   off those cores; sockets busy-poll the device queue (SO_BUSY_POLL)
+ * - Huge pages (-H): buffer pool arenas come from hugetlb pages when some
+ *   are reserved, else from 2MB-aligned ranges advised for transparent
+ *   huge pages, else from normal pages; the dashboard shows which
+ * - Rooms: everyone starts in "lobby", "/join <room>" switches
+ * - Clustering (-P): rooms are spread over several server processes by a
+ *   consistent-hash ring with bounded loads; joining a room that lives
+ *   elsewhere redirects the client there
+ * - Batches joins/leaves per room and tick into one presence delta
+ * - Drops resent messages (same client message id) per user session
+ * - At-least-once delivery: chat frames sent to a session are held (as
+ *   refs to the shared buffers) until the client acks them cumulatively,
+ *   and replayed when the user reconnects
+ * - Interns usernames to 32-bit ids: frames, log records, presence and
+ *   routing carry ids; clients get the name table once
+ * - Logs all messages to chat.binlog (compact binary records, see binlog.h;
+ *   `./logcat chat.binlog` prints the classic text form)
+ * - Standby replicas (-F): a second server tails the log over a
+ *   replication stream (sendfile) and takes over when the primary dies;
+ *   clients learn its address and fail over to it
+ * - Serves the last messages of a room to joiners from an LRU cache of
+ *   pre-encoded windows, falling back to chat.binlog on a miss
+ * - Accounts memory against a global budget and degrades under pressure
+ *   (shrink caches -> drop low-priority traffic -> refuse connections)
+ * - Moderation from an admin console on stdin: kick, ban by name, ban by
+ *   IP/CIDR (looked up in a prefix trie right after accept)
  *
  * Compile:
- *   gcc -pthread -o server server.c
+ *   gcc -pthread -o server server.c   (needs proto.h, binlog.h)
  *
  * Run:
  *   ./server 12345
+ *   ./server 12345 -m 128      (memory budget in MB, default 256)
+ *   ./server 12345 -c 16       (history cache budget in MB, default 32)
+ *   ./server 12345 -B bans.txt (console commands to run at startup)
+ *   ./server 12345 -i 4        (connections per IP address, default 16)
+ *   ./server 12345 -d          (redraw a stats dashboard every second)
+ *   ./server 12345 -r 5        (msgs/s per sender before dropping, default 20, 0 = off)
+ *   ./server 12345 -D          (group-commit the log, ack durable messages)
+ *   ./server 12345 -A 127.0.0.1/32            (let standbys from there replicate)
+ *   ./server 12346 -F 127.0.0.1:12345         (standby: run it in another directory)
+ *   ./server 12345 -P 127.0.0.1:12345,127.0.0.1:12346,127.0.0.1:12347
+ *                              (cluster: every node gets the same list, itself included)
+ *   ./server 12346 -U 127.0.0.1:12345         (relay under 12345, which needs -A)
+ *   ./server 12345 -M 239.255.0.1:5000        (multicast room traffic on the LAN)
+ *   ./server 12345 -M 239.255.0.1:5000,127.0.0.1   (... out of one interface, e.g. loopback)
+ *   ./server 12001 -P 127.0.0.1:12001,127.0.0.1:12002 -R 12000
+ *                              (shards: a cluster on this host, all also on port 12000)
+ *   ./server 12345 -L 2,3      (low latency: spin on cores 2 and 3, best isolated;
+ *                              same as --low-latency 2,3)
+ *   ./server 12345 -H          (buffer arenas on huge pages; reserve some with
+ *                              sysctl vm.nr_hugepages=64, or THP is tried)
  *
  * Use ngrok to expose: `ngrok tcp 12345`
  */
 
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "binlog.h"
+#include "proto.h"
+
 #define MAX_CLIENTS 1024
 #define BUF_SIZE 4096
 #define NAME_LEN 32
-#define LOGFILE "chat.log"
+#define LOGFILE "chat.binlog"
+#define LOG_BUF (64u<<10)
+#define SEGMENT_BYTES (1u<<20)
+#define MAX_NAMES 65536
+#define INTERN_BUCKETS 8192
+#define UID_NONE 0xffffffffu
+#define UID_SERVER 0
+#define MAX_ROOMS 256
+#define ROOM_LEN 32
+#define HISTORY_LEN 100
+#define CACHE_BUDGET_MB 32
+#define LOG_TAIL (1u<<20)
+#define TICK_MS 100
+#define NOTICE_NAMES 16
+#define MAX_SESSIONS (2*MAX_CLIENTS)
+#define DEDUP_WINDOW 256
+#define DEDUP_SLOTS 512   // power of two, 2x the window
+#define SESSION_TTL 300
+#define ACK_WINDOW 512    // unacked chat frames held per session
+#define MAX_DM_TARGETS BLOG_MAX_TARGETS
+#define BAN_NODES 65536
+#define MAX_PENDING 256
+#define HANDSHAKE_MS 5000
+#define MAX_PER_IP 16
+#define IP_SLOTS 32768    // power of two, > 2x (MAX_CLIENTS + MAX_PENDING + MAX_SPECTATORS)
+#define LAT_BUCKETS 20    // fan-out latency: <1us, <2us, <4us ... >=256ms
+#define DASH_MS 1000
+#define DASH_TOP 5
+#define CMS_DEPTH 4
+#define CMS_BITS 10
+#define CMS_WIDTH (1u<<CMS_BITS)
+#define SS_SLOTS 32
+#define HH_WINDOW_MS 5000
+#define RATE_LIMIT 20     // msgs/s per sender
+#define GROUP_MS 2        // -D: commit at least this often...
+#define GROUP_BYTES (32u<<10)   // ...or as soon as this much is buffered
+#define REPL_MS 10        // log flush / standby sync interval while replicating
+#define MAX_REPLICAS 4
+#define FAILOVER_MS 3000  // standby takes over after the primary is gone this long
+#define DIAL_MS 1000      // connect timeout for server-to-server links
+#define MAX_PEERS 16
+#define VNODES 64         // ring points per node
+#define LOAD_SLACK 25     // bounded loads: no node above (100+this)% of the average
+#define PEER_MS 1000      // load gossip / reconnect interval
+#define MAX_RELAYS 64     // downstream relays per server
+#define MAX_SPECTATORS 8192
+#define SPEC_SNDBUF (32u<<10)   // kernel doubles it; a spectator that fills it is cut off
+#define SPEC_RCVBUF 1024        // it never sends: the kernel minimum will do
+#define SPEC_BACKLOG (256u<<10) // live bytes a joining spectator may queue behind its join data
+#define MC_RING 256       // multicast messages per room kept for NACK repair
+#define MC_HEARTBEATS 10  // ticks a room's latest seq is re-announced after it last spoke
+#define MC_KEEPALIVE_MS 1000    // longest the stream goes without a datagram
+#define STEER_IPS 65536   // source addresses the steering map remembers
+#define LL_MAX_CPUS 64
+#define LL_HOLD_MS 500    // -L: a sender's thread spins this long after its last chat line;
+                          // well under the clients' 2 s probe, so idle clients do not hold cores
+#define LL_BUSY_US 50     // -L: SO_BUSY_POLL budget per blocking socket call
+
+#define MEM_BUDGET_MB 256
+#define ARENA_SIZE (1u<<20)
+#define HUGE_PAGE (2u<<20)  // -H: arena size and alignment
+#define CONN_COST (sizeof(client_t) + 2*BUF_SIZE)
+#define SPEC_COST (sizeof(spectator_t) + sizeof(spectator_t*))
+
+/*
+ * Clock.
+ * Every message is stamped once, when its frame arrives, and that value is
+ * what the wire, the log and the history all carry. The coarse clocks are
+ * read from the vDSO without a syscall (a few ms resolution, plenty for
+ * chat). Stamps are clamped so they never run backwards, even when the
+ * wall clock is stepped.
+ */
+atomic_ullong clock_last;
+
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    uint64_t last = atomic_load_explicit(&clock_last, memory_order_relaxed);
+    while (now > last && !atomic_compare_exchange_weak(&clock_last, &last, now)) {}
+    return now > last ? now : last;
+}
+
+// latency probes want more than the coarse clock's resolution
+uint64_t real_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// for deadlines and intervals only
+uint64_t mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t mono_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Stats. Relaxed atomics bumped on the hot paths and only ever read by the
+ * dashboard, which therefore takes no lock at all. Gauges (stat_clients
+ * and friends) are kept next to the state they mirror.
+ */
+atomic_ulong stat_msgs, stat_bytes_in, stat_bytes_out, stat_limited;
+atomic_int stat_clients, stat_pending, stat_presence, stat_unacked, stat_spectators, stat_mcast;
+atomic_size_t stat_logbuf;
+atomic_ulong lat_hist[LAT_BUCKETS];
+
+void stat_add(atomic_ulong *c, unsigned long n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+void stat_latency(uint64_t us) {
+    int b = 0;
+    while (b < LAT_BUCKETS-1 && us >= (1ull << b)) b++;
+    stat_add(&lat_hist[b], 1);
+}
+
+/*
+ * Heavy hitters, in fixed memory however many users come and go.
+ * Time is cut into HH_WINDOW_MS windows. Per window:
+ * - a count-min sketch of messages per sender: CMS_DEPTH rows of atomic
+ *   counters, lock-free, never under-counts. Its estimate of the current
+ *   plus the tail of the previous window is what rate limiting uses.
+ * - Space-Saving top-k (SS_SLOTS) over senders and over rooms: O(k) under
+ *   a lock held for a few dozen compares. Each counter overestimates by at
+ *   most its err.
+ * The tick rotates windows and copies the finished top-k into hh_snap,
+ * which is all the console and dashboard ever read.
+ */
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+    uint32_t err;
+} ss_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ss_entry_t e[SS_SLOTS];
+    int n;
+} ss_t;
+
+atomic_uint cms[2][CMS_DEPTH][CMS_WIDTH];
+atomic_uint hh_epoch;           // cms[hh_epoch & 1] is the current window
+atomic_ullong hh_start;         // mono_ms() at the start of the current window
+ss_t ss_talkers = { PTHREAD_MUTEX_INITIALIZER, { { 0, 0, 0 } }, 0 };
+ss_t ss_rooms = { PTHREAD_MUTEX_INITIALIZER, { { 0, 0, 0 } }, 0 };
+ss_entry_t snap_talkers[SS_SLOTS], snap_rooms[SS_SLOTS];
+int snap_ntalkers, snap_nrooms;
+pthread_mutex_t hh_snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+int rate_limit = RATE_LIMIT;
+
+const uint32_t cms_seed[CMS_DEPTH] = { 0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu };
+
+// multiply-shift: one multiply per row
+uint32_t cms_col(uint32_t key, int row) {
+    return ((key + 1) * cms_seed[row]) >> (32 - CMS_BITS);
+}
+
+uint32_t cms_get(int set, uint32_t key) {
+    uint32_t m = UINT32_MAX;
+    for (int r=0;r<CMS_DEPTH;r++) {
+        uint32_t v = atomic_load_explicit(&cms[set][r][cms_col(key, r)], memory_order_relaxed);
+        if (v < m) m = v;
+    }
+    return m;
+}
+
+void cms_add(int set, uint32_t key) {
+    for (int r=0;r<CMS_DEPTH;r++) {
+        atomic_fetch_add_explicit(&cms[set][r][cms_col(key, r)], 1, memory_order_relaxed);
+    }
+}
+
+void ss_add(ss_t *s, uint32_t key) {
+    pthread_mutex_lock(&s->lock);
+    int min = 0;
+    for (int i=0;i<s->n;i++) {
+        if (s->e[i].key == key) { s->e[i].count++; pthread_mutex_unlock(&s->lock); return; }
+        if (s->e[i].count < s->e[min].count) min = i;
+    }
+    if (s->n < SS_SLOTS) {
+        s->e[s->n++] = (ss_entry_t){ key, 1, 0 };
+    } else {
+        // evict the smallest; the newcomer inherits its count as possible error
+        s->e[min] = (ss_entry_t){ key, s->e[min].count + 1, s->e[min].count };
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+int ss_cmp(const void *a, const void *b) {
+    const ss_entry_t *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+// move the finished window's top-k into out (sorted), start an empty one
+int ss_rotate(ss_t *s, ss_entry_t *out) {
+    pthread_mutex_lock(&s->lock);
+    int n = s->n;
+    memcpy(out, s->e, n * sizeof(*out));
+    s->n = 0;
+    pthread_mutex_unlock(&s->lock);
+    qsort(out, n, sizeof(*out), ss_cmp);
+    return n;
+}
+
+// called from the tick
+void hh_rotate() {
+    uint64_t now = mono_ms();
+    if (now - atomic_load(&hh_start) < HH_WINDOW_MS) return;
+    // clear the oldest window, then make it current
+    unsigned next = (atomic_load(&hh_epoch) + 1) & 1;
+    for (int r=0;r<CMS_DEPTH;r++) {
+        for (uint32_t c=0;c<CMS_WIDTH;c++) atomic_store_explicit(&cms[next][r][c], 0, memory_order_relaxed);
+    }
+    atomic_store(&hh_start, now);
+    atomic_fetch_add(&hh_epoch, 1);
+    pthread_mutex_lock(&hh_snap_mutex);
+    snap_ntalkers = ss_rotate(&ss_talkers, snap_talkers);
+    snap_nrooms = ss_rotate(&ss_rooms, snap_rooms);
+    pthread_mutex_unlock(&hh_snap_mutex);
+}
+
+/*
+ * Count one ingested message; returns 1 if the sender is over rate_limit.
+ * The rate is a sliding-window estimate: this window's count plus the
+ * previous window's, scaled by how much of it still overlaps.
+ */
+int hh_ingest(uint32_t uid, int room) {
+    unsigned e = atomic_load(&hh_epoch);
+    int cur = e & 1;
+    cms_add(cur, uid);
+    ss_add(&ss_talkers, uid);
+    if (room >= 0) ss_add(&ss_rooms, room);
+    if (rate_limit <= 0) return 0;
+    uint64_t age = mono_ms() - atomic_load(&hh_start);
+    if (age > HH_WINDOW_MS) age = HH_WINDOW_MS;
+    double est = cms_get(cur, uid) + (double)cms_get(cur ^ 1, uid) * (HH_WINDOW_MS - age) / HH_WINDOW_MS;
+    return est > (double)rate_limit * HH_WINDOW_MS / 1000;
+}
+
+typedef struct session session_t;
 
 typedef struct {
     int sock;
-    char name[NAME_LEN];
+    int room;
+    int need_list;   // joined since the last tick: gets a full user list
+    uint32_t uid;    // UID_NONE until the hello frame arrived
+    uint32_t ip;     // peer IPv4 address, host order
+    uint32_t login_uid;  // interned from the hello frame by the accept loop
+    int login_new;       // ... and not announced yet
+    unsigned warned;     // hh_epoch + 1 when last told it is rate-limited
+    int mcast;           // gets room messages from the multicast group, not TCP
+    int ll_slot;         // -L: index of the core it spins on, -1 when it sleeps
+    uint64_t ll_last;    // -L: mono_ms of its last F_MSG
+    session_t *sess;
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+client_t *clients[MAX_CLIENTS];
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t room_seq[MAX_ROOMS];   // guarded by clients_mutex, like dm_seq
+uint32_t dm_seq;
+
+/*
+ * Spectators. A receive-only connection (F_WATCH) is nothing but its
+ * socket in its room's list: no thread, no session, no receive buffer.
+ * Fan-out walks the list right after the room's clients, under the same
+ * lock, with non-blocking sends: a spectator whose (deliberately small)
+ * send buffer cannot take a whole frame is shut down rather than allowed
+ * to stall everyone else. That only applies once it has joined: the names
+ * table and room history can be far bigger than any send buffer, so until
+ * they are out, spec_thread writes them as the socket drains and live
+ * frames queue behind them. One epoll thread (spec_thread) also watches
+ * for spectators to go away and owns the removal.
+ */
+typedef struct {
+    int fd;
+    uint32_t ip;
+    int room;
+    int slot;       // index in spec_rooms[room]
+    int dead;       // shut down by fan-out, spec_thread reaps it
+    int joining;    // join data not all sent yet: live frames go to pend
+    int small;      // send buffer cut down to SPEC_SNDBUF
+    struct msgbuf *join[2];     // names table, history (references)
+    int njoin;
+    size_t off;     // sent of join[0], or of pend once join is empty
+    char *pend;
+    size_t plen, pcap;
+} spectator_t;
+
+typedef struct {
+    spectator_t **v;
+    int n, cap;
+} spec_list_t;
+
+spec_list_t spec_rooms[MAX_ROOMS];  // guarded by clients_mutex
+
+void spec_cut(spectator_t *sp) {
+    sp->dead = 1;
+    shutdown(sp->fd, SHUT_RDWR);
+}
+
+// caller holds clients_mutex
+void spec_send(spectator_t *sp, const void *p, size_t n) {
+    if (sp->dead) return;
+    if (sp->joining) {
+        if (sp->plen + n > SPEC_BACKLOG) { spec_cut(sp); return; }
+        if (sp->plen + n > sp->pcap) {
+            size_t cap = sp->pcap ? sp->pcap * 2 : 4096;
+            while (cap < sp->plen + n) cap *= 2;
+            char *q = realloc(sp->pend, cap);
+            if (!q) { spec_cut(sp); return; }
+            sp->pend = q;
+            sp->pcap = cap;
+        }
+        memcpy(sp->pend + sp->plen, p, n);
+        sp->plen += n;
+        return;
+    }
+    // the join data may still sit in the kernel: shrink only once it has drained
+    int queued;
+    if (!sp->small && ioctl(sp->fd, SIOCOUTQ, &queued) == 0 && queued < (int)SPEC_SNDBUF) {
+        int snd = SPEC_SNDBUF;
+        setsockopt(sp->fd, SOL_SOCKET, SO_SNDBUF, &snd, sizeof(snd));
+        sp->small = 1;
+    }
+    ssize_t w = send(sp->fd, p, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (w > 0) stat_add(&stat_bytes_out, w);
+    if (w != (ssize_t)n) spec_cut(sp);
+}
+
+// caller holds clients_mutex
+void spec_fanout(int room, const void *p, size_t n) {
+    spec_list_t *l = &spec_rooms[room];
+    for (int i=0;i<l->n;i++) spec_send(l->v[i], p, n);
+}
+
+/*
+ * Memory accounting.
+ * Every long-lived allocation (connections, buffer pool arenas, caches,
+ * retained queues) is charged to a category. The sum against mem_budget
+ * picks a pressure tier; each tier adds one more degradation step.
+ */
+enum { MEM_CONN, MEM_BUF, MEM_CACHE, MEM_QUEUE, MEM_NCAT };
+enum { TIER_OK, TIER_SHRINK, TIER_SHED, TIER_REFUSE };
+enum { PRIO_LOW, PRIO_NORMAL };
+
+const char *mem_cat_name[MEM_NCAT] = { "conn", "buf", "cache", "queue" };
+const char *tier_name[] = { "ok", "shrink", "shed", "refuse" };
+
+size_t mem_budget = (size_t)MEM_BUDGET_MB << 20;
+atomic_size_t mem_used[MEM_NCAT];
+atomic_int mem_cur_tier;
+
+// shrinkers are called from allocation paths: they must not block (trylock only)
+typedef size_t (*shrinker_fn)(size_t want);
+#define MAX_SHRINKERS 8
+shrinker_fn shrinkers[MAX_SHRINKERS];
+int nshrinkers;
+
+size_t mem_total() {
+    size_t t = 0;
+    for (int i=0;i<MEM_NCAT;i++) t += atomic_load(&mem_used[i]);
+    return t;
+}
+
+int mem_tier() {
+    size_t pct = mem_total() * 100 / mem_budget;
+    if (pct >= 95) return TIER_REFUSE;
+    if (pct >= 85) return TIER_SHED;
+    if (pct >= 70) return TIER_SHRINK;
+    return TIER_OK;
+}
+
+void mem_register_shrinker(shrinker_fn fn) {
+    if (nshrinkers < MAX_SHRINKERS) shrinkers[nshrinkers++] = fn;
+}
+
+void mem_update_tier() {
+    int t = mem_tier();
+    int old = atomic_exchange(&mem_cur_tier, t);
+    if (t != old) {
+        fprintf(stderr, "mem: tier %s -> %s (%zu / %zu bytes)\n",
+                tier_name[old], tier_name[t], mem_total(), mem_budget);
+    }
+    if (t >= TIER_SHRINK) {
+        // ask caches to give back enough to get under the shrink mark
+        size_t target = mem_budget / 100 * 60;
+        size_t total = mem_total();
+        for (int i=0;i<nshrinkers && total > target;i++) {
+            shrinkers[i](total - target);
+            total = mem_total();
+        }
+    }
+}
+
+void mem_charge(int cat, size_t n) {
+    atomic_fetch_add(&mem_used[cat], n);
+    mem_update_tier();
+}
+
+void mem_release(int cat, size_t n) {
+    atomic_fetch_sub(&mem_used[cat], n);
+    if (atomic_load(&mem_cur_tier) != TIER_OK) mem_update_tier();
+}
+
+/*
+ * Message buffer pool.
+ * Encoded messages live in refcounted buffers so one encoding can be shared
+ * by every recipient, the history cache and (later) queues. Buffers come from
+ * size-classed free lists carved out of 1MB arenas; anything larger than the
+ * biggest class is malloc'd. Buffers in use are charged to MEM_BUF, so
+ * dropping cache references is what actually relieves pressure.
+ * With -H arenas are one 2MB huge page each, so fan-out touching buffers
+ * all over the pool costs a TLB entry per arena instead of one per 4KB:
+ * MAP_HUGETLB if the admin reserved pages, otherwise an aligned mapping
+ * with MADV_HUGEPAGE (transparent huge pages, if the kernel finds a free
+ * 2MB block when the arena is first touched), otherwise plain pages.
+ */
+typedef struct msgbuf {
+    struct msgbuf *next;
+    atomic_int refs;
+    uint32_t len;
+    uint32_t cap;
+    int8_t cls;
+    uint8_t prio;
+    char data[];
+} msgbuf_t;
+
+#define NCLASSES 4
+const uint32_t class_size[NCLASSES] = { 256, 1024, 8192, 65536 };
+
+typedef struct {
+    pthread_mutex_t lock;
+    msgbuf_t *free;
+} pool_class_t;
+
+pool_class_t pool[NCLASSES] = {
+    { PTHREAD_MUTEX_INITIALIZER, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL },
+};
+atomic_size_t pool_reserved;
+atomic_ulong pool_used[NCLASSES];   // buffers handed out, per class
+
+enum { ARENA_4K, ARENA_THP, ARENA_HUGETLB, ARENA_NKINDS };
+int huge_pages;             // -H
+size_t arena_size = ARENA_SIZE;
+atomic_ulong arena_count[ARENA_NKINDS];
+
+char *arena_map() {
+    const int prot = PROT_READ|PROT_WRITE, flags = MAP_PRIVATE|MAP_ANONYMOUS;
+    static int warned_tlb, warned_thp;
+    if (huge_pages) {
+        char *p = mmap(NULL, arena_size, prot, flags|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) { atomic_fetch_add(&arena_count[ARENA_HUGETLB], 1); return p; }
+        if (!warned_tlb++) perror("-H: no hugetlb pages, trying transparent huge pages");
+        // THP needs 2MB alignment: map one page extra and trim both ends
+        char *raw = mmap(NULL, arena_size + HUGE_PAGE, prot, flags, -1, 0);
+        if (raw == MAP_FAILED) { perror("mmap"); return NULL; }
+        char *a = (char*)(((uintptr_t)raw + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+        if (a > raw) munmap(raw, a - raw);
+        if (raw + HUGE_PAGE > a) munmap(a + arena_size, raw + HUGE_PAGE - a);
+        if (madvise(a, arena_size, MADV_HUGEPAGE) == 0) { atomic_fetch_add(&arena_count[ARENA_THP], 1); return a; }
+        if (!warned_thp++) perror("-H: madvise, using normal pages");
+        atomic_fetch_add(&arena_count[ARENA_4K], 1);
+        return a;
+    }
+    char *p = mmap(NULL, arena_size, prot, flags, -1, 0);
+    if (p == MAP_FAILED) { perror("mmap"); return NULL; }
+    atomic_fetch_add(&arena_count[ARENA_4K], 1);
+    return p;
+}
+
+// process-wide anonymous memory on transparent huge pages, in kB
+unsigned long thp_kb() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    char line[128];
+    unsigned long kb = 0;
+    while (fgets(line, sizeof(line), f) && sscanf(line, "AnonHugePages: %lu kB", &kb) != 1);
+    fclose(f);
+    return kb;
+}
+
+// carve a fresh arena into buffers of class c; called with pool[c].lock held
+int pool_grow(int c) {
+    if (atomic_load(&pool_reserved) + arena_size > mem_budget) return -1;
+    char *arena = arena_map();
+    if (!arena) return -1;
+    size_t stride = sizeof(msgbuf_t) + class_size[c];
+    for (size_t off = 0; off + stride <= arena_size; off += stride) {
+        msgbuf_t *b = (msgbuf_t*)(arena + off);
+        b->cls = c;
+        b->cap = class_size[c];
+        b->next = pool[c].free;
+        pool[c].free = b;
+    }
+    atomic_fetch_add(&pool_reserved, arena_size);
+    return 0;
+}
+
+msgbuf_t *msgbuf_alloc(size_t size, int prio) {
+    msgbuf_t *b = NULL;
+    int c = 0;
+    while (c < NCLASSES && class_size[c] < size) c++;
+    if (c == NCLASSES) {
+        if (mem_total() + size > mem_budget) return NULL;
+        b = malloc(sizeof(msgbuf_t) + size);
+        if (!b) return NULL;
+        b->cls = -1;
+        b->cap = size;
+    } else {
+        pthread_mutex_lock(&pool[c].lock);
+        if (!pool[c].free) pool_grow(c);
+        b = pool[c].free;
+        if (b) pool[c].free = b->next;
+        pthread_mutex_unlock(&pool[c].lock);
+        if (!b) return NULL;
+        atomic_fetch_add_explicit(&pool_used[c], 1, memory_order_relaxed);
+    }
+    // charge outside the class lock: shrinkers may hand buffers back to it
+    mem_charge(MEM_BUF, sizeof(msgbuf_t) + b->cap);
+    atomic_init(&b->refs, 1);
+    b->len = 0;
+    b->prio = prio;
+    b->next = NULL;
+    return b;
+}
+
+msgbuf_t *msgbuf_ref(msgbuf_t *b) {
+    atomic_fetch_add(&b->refs, 1);
+    return b;
+}
+
+void msgbuf_unref(msgbuf_t *b) {
+    if (atomic_fetch_sub(&b->refs, 1) != 1) return;
+    mem_release(MEM_BUF, sizeof(msgbuf_t) + b->cap);
+    if (b->cls < 0) {
+        free(b);
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool_used[b->cls], 1, memory_order_relaxed);
+    pthread_mutex_lock(&pool[b->cls].lock);
+    b->next = pool[b->cls].free;
+    pool[b->cls].free = b;
+    pthread_mutex_unlock(&pool[b->cls].lock);
+}
+
+// every write to a client goes through here, for the byte counter
+void send_bytes(int sock, const void *p, size_t n) {
+    ssize_t w = send(sock, p, n, MSG_NOSIGNAL);
+    if (w < 0) perror("send");
+    else stat_add(&stat_bytes_out, w);
+}
+
+void send_buf(int sock, const msgbuf_t *b) {
+    send_bytes(sock, b->data, b->len);
+}
+
+// a server-formatted line, framed as D_TEXT
+void send_to_sock(int sock, const char *msg) {
+    char out[sizeof(down_hdr_t) + BUF_SIZE];
+    size_t n = strlen(msg);
+    if (n > BUF_SIZE) n = BUF_SIZE;
+    size_t h = put_down_hdr(out, D_TEXT, 0, UID_SERVER, n);
+    memcpy(out + h, msg, n);
+    send_bytes(sock, out, h + n);
+}
+
+// under pressure, low-priority traffic (presence, join/leave notices) is shed
+int should_shed(int prio) {
+    return prio == PRIO_LOW && atomic_load(&mem_cur_tier) >= TIER_SHED;
+}
+
+/*
+ * Rooms. Ids index room_names and never get reused; room 0 is the lobby.
+ */
+char room_names[MAX_ROOMS][ROOM_LEN] = { "lobby" };
+int nrooms = 1;
+pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int room_find(const char *name, int create) {
+    int id = -1;
+    size_t n = strlen(name);
+    if (n == 0 || n >= ROOM_LEN) return -1;
+    for (size_t i=0;i<n;i++) {
+        char ch = name[i];
+        if (!((ch>='a'&&ch<='z') || (ch>='A'&&ch<='Z') || (ch>='0'&&ch<='9') || ch=='-' || ch=='_')) return -1;
+    }
+    pthread_mutex_lock(&rooms_mutex);
+    for (int i=0;i<nrooms;i++) {
+        if (strcmp(room_names[i], name) == 0) { id = i; break; }
+    }
+    if (id < 0 && create && nrooms < MAX_ROOMS) {
+        id = nrooms;
+        strcpy(room_names[id], name);
+        nrooms++;
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    return id;
+}
+
+/*
+ * Username interning.
+ * Each distinct username gets a dense 32-bit id the first time it is seen;
+ * everything past login (frames, log records, presence, routing, sessions)
+ * carries ids and only this table holds strings. A name that has spoken,
+ * been logged or banned is kept for good, so anyone holding such an id may
+ * read intern_tab[id] without a lock. A name that only logged in is held by
+ * its connections and its session; when the last of them goes the entry is
+ * unlinked and its id reused, so hellos with throwaway names cannot fill
+ * the table. Clients learn names from D_NAME frames: the whole table once
+ * at login (one shared buffer, rebuilt when the table changes) and each new
+ * name once, which also overwrites whatever a reused id meant before.
+ */
+typedef struct {
+    char name[NAME_LEN];
+    uint32_t next;       // hash chain (free list once reclaimed), UID_NONE terminates
+    uint32_t log_seg;    // binlog segment that last defined this id
+    client_t *conn;      // online connection, guarded by clients_mutex
+    uint32_t refs;       // connections + session, guarded by intern_mutex
+    atomic_uchar kept;   // never reclaimed
+    atomic_uchar banned;
+} intern_t;
+
+enum { INTERN_FIND, INTERN_KEEP, INTERN_REF };
+
+intern_t *intern_tab;
+atomic_uint nnames;
+uint32_t intern_buckets[INTERN_BUCKETS];
+uint32_t intern_free = UID_NONE;
+uint32_t names_gen;         // bumped whenever a name is added or reclaimed
+msgbuf_t *names_blob;
+uint32_t names_blob_gen;
+pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (uint8_t)*s++; h *= 16777619u; }
+    return h;
+}
+
+const char *uid_name(uint32_t uid) {
+    return uid < atomic_load(&nnames) ? intern_tab[uid].name : "?";
+}
+
+// caller holds intern_mutex
+uint32_t intern_find_locked(const char *name) {
+    uint32_t id = intern_buckets[name_hash(name) % INTERN_BUCKETS];
+    while (id != UID_NONE && strcmp(intern_tab[id].name, name) != 0) id = intern_tab[id].next;
+    return id;
+}
+
+// resolve a batch of names under one lock; unknown names map to UID_NONE.
+// The ids are about to be logged as DM targets, so they are kept right here:
+// otherwise a target's last hold could drop and the id be reused before that
+void intern_find_many(char names[][NAME_LEN], int n, uint32_t *out) {
+    pthread_mutex_lock(&intern_mutex);
+    for (int i=0;i<n;i++) {
+        out[i] = intern_find_locked(names[i]);
+        if (out[i] != UID_NONE) atomic_store(&intern_tab[out[i]].kept, 1);
+    }
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+// mode INTERN_FIND only looks up; INTERN_KEEP creates a permanent entry
+// (or makes an existing one permanent); INTERN_REF creates if needed and
+// takes a ref for a login, dropped with intern_unref. Returns the id,
+// UID_NONE if absent or the table is full; *is_new tells the caller it has
+// to announce the name
+uint32_t intern(const char *name, int mode, int *is_new) {
+    uint32_t b = name_hash(name) % INTERN_BUCKETS;
+    if (is_new) *is_new = 0;
+    pthread_mutex_lock(&intern_mutex);
+    uint32_t id = intern_find_locked(name);
+    if (id == UID_NONE && mode != INTERN_FIND) {
+        if (intern_free != UID_NONE) {
+            id = intern_free;
+            intern_free = intern_tab[id].next;
+        } else if (atomic_load(&nnames) < MAX_NAMES) {
+            id = atomic_load(&nnames);
+            mem_charge(MEM_CONN, sizeof(intern_t));
+        }
+        if (id != UID_NONE) {
+            intern_t *e = &intern_tab[id];
+            strncpy(e->name, name, NAME_LEN-1);
+            e->next = intern_buckets[b];
+            intern_buckets[b] = id;
+            // publish only after the entry is complete
+            if (id == atomic_load(&nnames)) atomic_store(&nnames, id + 1);
+            names_gen++;
+            if (is_new) *is_new = 1;
+        }
+    }
+    if (id != UID_NONE && mode == INTERN_KEEP) atomic_store(&intern_tab[id].kept, 1);
+    if (id != UID_NONE && mode == INTERN_REF) intern_tab[id].refs++;
+    pthread_mutex_unlock(&intern_mutex);
+    return id;
+}
+
+// caller holds intern_mutex
+void intern_reclaim_locked(uint32_t id) {
+    intern_t *e = &intern_tab[id];
+    uint32_t *link = &intern_buckets[name_hash(e->name) % INTERN_BUCKETS];
+    while (*link != id) link = &intern_tab[*link].next;
+    *link = e->next;
+    memset(e->name, 0, NAME_LEN);
+    e->log_seg = 0;
+    atomic_store(&e->banned, 0);
+    e->next = intern_free;
+    intern_free = id;
+    names_gen++;
+}
+
+// more holders of a login ref (a session)
+void intern_ref(uint32_t id) {
+    pthread_mutex_lock(&intern_mutex);
+    intern_tab[id].refs++;
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+void intern_unref(uint32_t id) {
+    if (id == UID_NONE) return;
+    pthread_mutex_lock(&intern_mutex);
+    intern_t *e = &intern_tab[id];
+    if (--e->refs == 0 && !atomic_load(&e->kept)) intern_reclaim_locked(id);
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+// the id is now stored somewhere that outlives its holders (history, log);
+// set under intern_mutex, where intern_unref tests it, so the two cannot cross
+void intern_keep(uint32_t id) {
+    if (atomic_load_explicit(&intern_tab[id].kept, memory_order_relaxed)) return;
+    pthread_mutex_lock(&intern_mutex);
+    atomic_store(&intern_tab[id].kept, 1);
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+void intern_init() {
+    intern_tab = calloc(MAX_NAMES, sizeof(intern_t));
+    if (!intern_tab) { perror("calloc"); exit(1); }
+    for (int i=0;i<INTERN_BUCKETS;i++) intern_buckets[i] = UID_NONE;
+    intern("server", INTERN_KEEP, NULL);
+}
+
+size_t put_name_frame(char *p, uint32_t uid) {
+    size_t l = strlen(intern_tab[uid].name);
+    size_t h = put_down_hdr(p, D_NAME, 0, uid, l);
+    memcpy(p + h, intern_tab[uid].name, l);
+    return h + l;
+}
+
+void announce_name(uint32_t uid) {
+    char out[sizeof(down_hdr_t) + NAME_LEN];
+    size_t n = put_name_frame(out, uid);
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (clients[i]) send_bytes(clients[i]->sock, out, n);
+    }
+    for (int r=0;r<MAX_ROOMS;r++) spec_fanout(r, out, n);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// intern and, for a first sighting, tell every connected client the name
+uint32_t intern_user(const char *name) {
+    int is_new;
+    uint32_t uid = intern(name, INTERN_KEEP, &is_new);
+    if (is_new) announce_name(uid);
+    return uid;
+}
+
+// ref to the D_NAME frames for every interned name
+msgbuf_t *names_table() {
+    pthread_mutex_lock(&intern_mutex);
+    uint32_t n = atomic_load(&nnames);
+    if (!names_blob || names_blob_gen != names_gen) {
+        if (names_blob) msgbuf_unref(names_blob);
+        names_blob = msgbuf_alloc((size_t)n * (sizeof(down_hdr_t) + NAME_LEN), PRIO_NORMAL);
+        if (names_blob) {
+            for (uint32_t i=0;i<n;i++) {
+                if (intern_tab[i].name[0]) names_blob->len += put_name_frame(names_blob->data + names_blob->len, i);
+            }
+        }
+        names_blob_gen = names_gen;
+    }
+    msgbuf_t *out = names_blob ? msgbuf_ref(names_blob) : NULL;
+    pthread_mutex_unlock(&intern_mutex);
+    return out;
+}
+
+/*
+ * Binary log writer (record format in binlog.h).
+ * Records are encoded into log_buf under log_mutex and written out once per
+ * tick, or as soon as the buffer fills, so logging a message costs a few
+ * varint stores instead of strftime + fopen/fprintf/fclose. Names and rooms
+ * get small ids that are defined once per segment; a new segment (BR_BASE)
+ * starts every SEGMENT_BYTES and its offset is remembered so history misses
+ * only scan the tail of the file.
+ */
+int log_fd = -1;
+uint8_t log_buf[LOG_BUF];
+size_t log_len;
+off_t log_off;            // bytes already written to the file
+uint64_t log_last_ts;
+uint32_t log_seg;         // current segment number, starts at 1
+off_t *seg_offs;
+int nsegs, segs_cap;
+uint32_t room_seg[MAX_ROOMS];
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+int durable;              // -D
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;     // wakes the committer early
+uint64_t log_synced;      // file offset known to be on disk
+pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;    // log_off moved: ship it
+atomic_int log_failed;    // a write or fdatasync failed: nothing more is written or acked
+
+// the log is not trusted again: a retried fdatasync can report success after
+// the kernel dropped the dirty pages. Stop writing and syncing, and fail
+// everyone waiting for a durable ack
+void log_fail(const char *what) {
+    if (atomic_exchange(&log_failed, 1)) return;
+    perror(what);
+    fprintf(stderr, "log: %s is no longer written, messages are not acked as durable\n", LOGFILE);
+    pthread_mutex_lock(&sync_mutex);
+    pthread_cond_broadcast(&sync_cond);
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+// caller holds log_mutex
+void log_flush_locked() {
+    size_t off = 0;
+    while (off < log_len && !atomic_load(&log_failed)) {
+        ssize_t w = write(log_fd, log_buf + off, log_len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) { log_fail("write " LOGFILE); break; }
+        off += w;
+    }
+    // only what reached the file counts (for syncs, acks and standbys);
+    // the rest goes with the failed log
+    log_off += off;
+    log_len = 0;
+    atomic_store_explicit(&stat_logbuf, 0, memory_order_relaxed);
+    pthread_cond_broadcast(&repl_cond);
+}
+
+void log_flush() {
+    pthread_mutex_lock(&log_mutex);
+    if (log_len) log_flush_locked();
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void log_emit(const uint8_t *body, size_t len) {
+    if (log_len + len + 16 > LOG_BUF) log_flush_locked();
+    log_len += blog_frame(log_buf + log_len, body, len);
+    if (durable && log_len >= GROUP_BYTES) pthread_cond_signal(&log_cond);
+    atomic_store_explicit(&stat_logbuf, log_len, memory_order_relaxed);
+}
+
+// base: the stamp of the record that follows, so it needs no clamping
+void log_new_segment(uint64_t base) {
+    uint8_t body[16];
+    if (nsegs == segs_cap) {
+        segs_cap = segs_cap ? segs_cap * 2 : 64;
+        seg_offs = realloc(seg_offs, segs_cap * sizeof(*seg_offs));
+    }
+    seg_offs[nsegs++] = log_off + log_len;
+    log_seg++;
+    log_last_ts = base;
+    body[0] = BR_BASE;
+    log_emit(body, 1 + put_varint(body + 1, log_last_ts));
+}
+
+// emit a BR_NAME definition if this segment lacks one for uid
+void log_name_def(uint32_t uid) {
+    intern_t *e = &intern_tab[uid];
+    if (e->log_seg == log_seg) return;
+    intern_keep(uid);
+    uint8_t body[NAME_LEN + 16];
+    body[0] = BR_NAME;
+    size_t n = 1 + put_varint(body + 1, uid);
+    size_t l = strlen(e->name);
+    memcpy(body + n, e->name, l);
+    log_emit(body, n + l);
+    e->log_seg = log_seg;
+}
+
+void log_room_def(int room) {
+    if (room_seg[room] == log_seg) return;
+    uint8_t body[ROOM_LEN + 16];
+    body[0] = BR_ROOM;
+    size_t n = 1 + put_varint(body + 1, room);
+    size_t l = strlen(room_names[room]);
+    memcpy(body + n, room_names[room], l);
+    log_emit(body, n + l);
+    room_seg[room] = log_seg;
+}
+
+void log_msg(uint64_t ts, int room, uint32_t sender, int flags, const uint32_t *targets, int ntargets,
+             const char *text, size_t len) {
+    uint8_t body[BUF_SIZE + 16 + (BLOG_MAX_TARGETS+4)*10];
+    if (len > BUF_SIZE) len = BUF_SIZE;
+    if (ntargets > BLOG_MAX_TARGETS) ntargets = BLOG_MAX_TARGETS;
+    pthread_mutex_lock(&log_mutex);
+    if (log_off + log_len - seg_offs[nsegs-1] >= SEGMENT_BYTES) log_new_segment(ts);
+    log_name_def(sender);
+    for (int i=0;i<ntargets;i++) log_name_def(targets[i]);
+    log_room_def(room);
+    // stamps taken on other threads may reach the log slightly out of order:
+    // those are stored as a step back, so the logged ts is the one sent
+    uint64_t delta;
+    if (ts >= log_last_ts) {
+        delta = ts - log_last_ts;
+        log_last_ts = ts;
+    } else {
+        delta = log_last_ts - ts;
+        flags |= BL_EARLIER;
+    }
+    size_t n = 0;
+    body[n++] = BR_MSG;
+    n += put_varint(body + n, delta);
+    n += put_varint(body + n, sender);
+    n += put_varint(body + n, room);
+    body[n++] = flags;
+    if (flags & BL_PRIVATE) {
+        n += put_varint(body + n, ntargets);
+        for (int i=0;i<ntargets;i++) n += put_varint(body + n, targets[i]);
+    }
+    memcpy(body + n, text, len);
+    log_emit(body, n + len);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/*
+ * Group commit (-D). One thread writes out whatever has been buffered
+ * every GROUP_MS, or sooner once GROUP_BYTES are waiting, and covers it
+ * with a single fdatasync. The write happens under log_mutex as usual; the
+ * sync does not, so appenders never wait on the disk. Senders block in
+ * log_wait_durable() until the commit covering their record is done, so
+ * one fdatasync acknowledges everything that arrived in the window. A failed
+ * write or sync ends it for good (log_fail): waiters get an error instead of
+ * an ack, and the file is neither written nor synced again.
+ */
+uint64_t log_end() {
+    pthread_mutex_lock(&log_mutex);
+    uint64_t end = log_off + log_len;
+    pthread_mutex_unlock(&log_mutex);
+    return end;
+}
+
+// 0 once everything up to end is on disk, -1 if the log failed first
+int log_wait_durable(uint64_t end) {
+    pthread_mutex_lock(&sync_mutex);
+    while (log_synced < end && !atomic_load(&log_failed)) pthread_cond_wait(&sync_cond, &sync_mutex);
+    int r = log_synced >= end ? 0 : -1;
+    pthread_mutex_unlock(&sync_mutex);
+    return r;
+}
+
+void *log_commit_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec dl;
+        clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_nsec += GROUP_MS * 1000000L;
+        if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        pthread_mutex_lock(&log_mutex);
+        if (log_len < GROUP_BYTES) pthread_cond_timedwait(&log_cond, &log_mutex, &dl);
+        if (log_len) log_flush_locked();
+        uint64_t end = log_off;
+        pthread_mutex_unlock(&log_mutex);
+        if (atomic_load(&log_failed)) break;
+        if (end == log_synced) continue;    // only this thread writes log_synced
+        if (fdatasync(log_fd) < 0) { log_fail("fdatasync " LOGFILE); break; }
+        pthread_mutex_lock(&sync_mutex);
+        log_synced = end;
+        pthread_cond_broadcast(&sync_cond);
+        pthread_mutex_unlock(&sync_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Walk records from offset `from`, calling fn for each valid one. Returns the
+ * offset just past the last valid record (a torn or corrupt tail stops it).
+ */
+typedef void (*log_visit_fn)(const blog_rec_t *r, off_t at, void *ctx);
+
+off_t log_scan(int fd, off_t from, log_visit_fn fn, void *ctx) {
+    size_t cap = BLOG_MAX_BODY + 64*1024;
+    uint8_t *buf = malloc(cap);
+    if (!buf) return from;
+    size_t have = 0, pos = 0;
+    off_t base = from;     // file offset of buf[0]
+    uint64_t last_ts = 0;
+    int eof = 0;
+    while (1) {
+        if (!eof && have - pos < BLOG_MAX_BODY + 16) {
+            memmove(buf, buf + pos, have - pos);
+            base += pos; have -= pos; pos = 0;
+            ssize_t r = pread(fd, buf + have, cap - have, base + have);
+            if (r <= 0) eof = 1; else have += r;
+        }
+        blog_rec_t rec;
+        long used = blog_parse(buf + pos, have - pos, &rec, &last_ts);
+        if (used <= 0) {
+            if (used == 0 && !eof) continue;
+            break;
+        }
+        fn(&rec, base + pos, ctx);
+        pos += used;
+    }
+    free(buf);
+    return base + pos;
+}
+
+void log_note_segment(const blog_rec_t *r, off_t at, void *ctx) {
+    (void)ctx;
+    if (r->type != BR_BASE) return;
+    if (nsegs == segs_cap) {
+        segs_cap = segs_cap ? segs_cap * 2 : 64;
+        seg_offs = realloc(seg_offs, segs_cap * sizeof(*seg_offs));
+    }
+    seg_offs[nsegs++] = at;
+}
+
+// open (or create) the log, index existing segments and cut a torn tail
+void log_open() {
+    crc32c_init();
+    log_fd = open(LOGFILE, O_RDWR|O_CREAT, 0644);
+    if (log_fd < 0) { perror("open " LOGFILE); exit(1); }
+    char magic[BLOG_MAGIC_LEN];
+    off_t size = lseek(log_fd, 0, SEEK_END);
+    if (size == 0) {
+        if (write(log_fd, BLOG_MAGIC, BLOG_MAGIC_LEN) != BLOG_MAGIC_LEN) { perror("write " LOGFILE); exit(1); }
+        size = BLOG_MAGIC_LEN;
+    } else if (pread(log_fd, magic, BLOG_MAGIC_LEN, 0) != BLOG_MAGIC_LEN || memcmp(magic, BLOG_MAGIC, BLOG_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a chat binlog\n", LOGFILE);
+        exit(1);
+    }
+    off_t end = log_scan(log_fd, BLOG_MAGIC_LEN, log_note_segment, NULL);
+    if (end < size) {
+        fprintf(stderr, "%s: dropping %lld bytes of torn tail\n", LOGFILE, (long long)(size - end));
+        if (ftruncate(log_fd, end) < 0) perror("ftruncate");
+    }
+    log_off = lseek(log_fd, end, SEEK_SET);
+    pthread_mutex_lock(&log_mutex);
+    log_new_segment(now_ms());
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/*
+ * History cache.
+ * One entry per room holds refs to the last HISTORY_LEN broadcast buffers and,
+ * once someone joins, a single pre-encoded blob of the whole window that all
+ * concurrent joiners share. Entries sit on an LRU list and are evicted to stay
+ * under cache_budget (and by the memory shrinker). A miss is filled from the
+ * tail of chat.log; joiners arriving while that load runs wait for it instead
+ * of reading the file again.
+ */
+typedef struct hist_entry {
+    int room;
+    int loading;
+    msgbuf_t *ring[HISTORY_LEN];
+    int head, count;
+    size_t bytes;
+    msgbuf_t *blob;
+    struct hist_entry *prev, *next;
+} hist_entry_t;
+
+hist_entry_t *hist_by_room[MAX_ROOMS];
+hist_entry_t *lru_head, *lru_tail;
+size_t cache_bytes;
+size_t cache_budget = (size_t)CACHE_BUDGET_MB << 20;
+pthread_mutex_t hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hist_cond = PTHREAD_COND_INITIALIZER;
+
+size_t buf_cost(const msgbuf_t *b) { return sizeof(msgbuf_t) + b->cap; }
+
+void lru_unlink(hist_entry_t *e) {
+    if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+void lru_push_front(hist_entry_t *e) {
+    e->next = lru_head;
+    if (lru_head) lru_head->prev = e;
+    lru_head = e;
+    if (!lru_tail) lru_tail = e;
+}
+
+// caller holds hist_mutex; returns bytes given back
+size_t hist_drop_blob(hist_entry_t *e) {
+    if (!e->blob) return 0;
+    size_t n = buf_cost(e->blob);
+    msgbuf_unref(e->blob);
+    e->blob = NULL;
+    e->bytes -= n;
+    cache_bytes -= n;
+    return n;
+}
+
+size_t hist_evict(hist_entry_t *e) {
+    size_t freed = hist_drop_blob(e);
+    for (int i=0;i<e->count;i++) {
+        msgbuf_unref(e->ring[(e->head + i) % HISTORY_LEN]);
+    }
+    freed += e->bytes + sizeof(*e);
+    cache_bytes -= e->bytes;
+    hist_by_room[e->room] = NULL;
+    lru_unlink(e);
+    free(e);
+    mem_release(MEM_CACHE, sizeof(hist_entry_t));
+    return freed;
+}
+
+// evict least recently used entries (never ones mid-load) until under limit
+size_t hist_trim(size_t limit) {
+    size_t freed = 0;
+    hist_entry_t *e = lru_tail;
+    while (e && cache_bytes > limit) {
+        hist_entry_t *prev = e->prev;
+        if (!e->loading) freed += hist_evict(e);
+        e = prev;
+    }
+    return freed;
+}
+
+size_t hist_shrink(size_t want) {
+    if (pthread_mutex_trylock(&hist_mutex) != 0) return 0;
+    size_t limit = cache_bytes > want ? cache_bytes - want : 0;
+    size_t freed = hist_trim(limit);
+    pthread_mutex_unlock(&hist_mutex);
+    return freed;
+}
+
+// caller holds hist_mutex
+void hist_push(hist_entry_t *e, msgbuf_t *b) {
+    if (e->count == HISTORY_LEN) {
+        msgbuf_t *old = e->ring[e->head];
+        e->bytes -= buf_cost(old);
+        cache_bytes -= buf_cost(old);
+        msgbuf_unref(old);
+        e->head = (e->head + 1) % HISTORY_LEN;
+        e->count--;
+    }
+    e->ring[(e->head + e->count) % HISTORY_LEN] = msgbuf_ref(b);
+    e->count++;
+    e->bytes += buf_cost(b);
+    cache_bytes += buf_cost(b);
+    hist_drop_blob(e);
+}
+
+// record a broadcast; rooms nobody has asked history for yet are not cached
+void hist_append(int room, msgbuf_t *b) {
+    pthread_mutex_lock(&hist_mutex);
+    hist_entry_t *e = hist_by_room[room];
+    if (e && !e->loading) {
+        hist_push(e, b);
+        hist_trim(cache_budget);
+    }
+    pthread_mutex_unlock(&hist_mutex);
+}
+
+/*
+ * Cache miss: replay the log tail. Room and name ids are per segment (and
+ * segments may come from an earlier run), so the room is matched by name
+ * through BR_ROOM and senders are re-interned from BR_NAME.
+ */
+typedef struct {
+    hist_entry_t *e;
+    int64_t room_id;          // id of e's room in the current segment, -1 if none
+    char (*names)[NAME_LEN];  // id -> name for the current segment
+    uint32_t nnames;
+} hist_scan_t;
+
+void hist_visit(const blog_rec_t *r, off_t at, void *ctx) {
+    (void)at;
+    hist_scan_t *hs = ctx;
+    if (r->type == BR_BASE) {
+        hs->room_id = -1;
+        hs->nnames = 0;
+    } else if (r->type == BR_ROOM) {
+        const char *want = room_names[hs->e->room];
+        if (r->len == strlen(want) && memcmp(r->data, want, r->len) == 0) hs->room_id = r->id;
+    } else if (r->type == BR_NAME && r->len < NAME_LEN) {
+        if (r->id >= hs->nnames) {
+            uint32_t n = r->id + 64;
+            void *p = realloc(hs->names, n * NAME_LEN);
+            if (!p) return;
+            hs->names = p;
+            memset(hs->names[hs->nnames], 0, (n - hs->nnames) * NAME_LEN);
+            hs->nnames = n;
+        }
+        memcpy(hs->names[r->id], r->data, r->len);
+        hs->names[r->id][r->len] = '\0';
+    } else if (r->type == BR_MSG && r->room == hs->room_id && !(r->flags & (BL_NOTICE|BL_PRIVATE))) {
+        if (r->sender >= hs->nnames || !hs->names[r->sender][0]) return;
+        uint32_t uid = intern_user(hs->names[r->sender]);
+        if (uid == UID_NONE) return;
+        msgbuf_t *b = msgbuf_alloc(sizeof(down_hdr_t) + sizeof(msg_meta_t) + r->len, PRIO_NORMAL);
+        if (!b) return;
+        b->len = put_down_hdr(b->data, D_MSG, hs->e->room, uid, sizeof(msg_meta_t) + r->len);
+        b->len += put_msg_meta(b->data + b->len, 0, r->ts);
+        memcpy(b->data + b->len, r->data, r->len);
+        b->len += r->len;
+        pthread_mutex_lock(&hist_mutex);
+        hist_push(hs->e, b);
+        pthread_mutex_unlock(&hist_mutex);
+        msgbuf_unref(b);
+    }
+}
+
+void hist_load(hist_entry_t *e) {
+    log_flush();
+    pthread_mutex_lock(&log_mutex);
+    // start at the newest segment that still leaves LOG_TAIL bytes to read
+    off_t end = log_off, from = seg_offs[0];
+    for (int i=nsegs-1;i>=0;i--) {
+        from = seg_offs[i];
+        if (end - from >= LOG_TAIL) break;
+    }
+    pthread_mutex_unlock(&log_mutex);
+    hist_scan_t hs = { e, -1, NULL, 0 };
+    log_scan(log_fd, from, hist_visit, &hs);
+    free(hs.names);
+}
+
+// returns a ref to the room's encoded window (NULL when empty)
+msgbuf_t *hist_get(int room) {
+    pthread_mutex_lock(&hist_mutex);
+    hist_entry_t *e;
+    // waiters re-check after waking: the entry may have been evicted meanwhile
+    while ((e = hist_by_room[room]) && e->loading) pthread_cond_wait(&hist_cond, &hist_mutex);
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        if (!e) { pthread_mutex_unlock(&hist_mutex); return NULL; }
+        mem_charge(MEM_CACHE, sizeof(*e));
+        e->room = room;
+        e->loading = 1;
+        hist_by_room[room] = e;
+        lru_push_front(e);
+        pthread_mutex_unlock(&hist_mutex);
+        hist_load(e);
+        pthread_mutex_lock(&hist_mutex);
+        e->loading = 0;
+        pthread_cond_broadcast(&hist_cond);
+    }
+    if (!e->blob && e->count > 0) {
+        // led by a D_HISTORY frame, so clients do not count these as delivered
+        size_t total = sizeof(down_hdr_t) + 4;
+        for (int i=0;i<e->count;i++) total += e->ring[(e->head + i) % HISTORY_LEN]->len;
+        msgbuf_t *blob = msgbuf_alloc(total, PRIO_NORMAL);
+        if (blob) {
+            blob->len = put_down_hdr(blob->data, D_HISTORY, room, UID_SERVER, 4);
+            uint32_t v = htonl(e->count);
+            memcpy(blob->data + blob->len, &v, 4);
+            blob->len += 4;
+            for (int i=0;i<e->count;i++) {
+                msgbuf_t *b = e->ring[(e->head + i) % HISTORY_LEN];
+                memcpy(blob->data + blob->len, b->data, b->len);
+                blob->len += b->len;
+            }
+            e->blob = blob;
+            e->bytes += buf_cost(blob);
+            cache_bytes += buf_cost(blob);
+        }
+    }
+    lru_unlink(e);
+    lru_push_front(e);
+    msgbuf_t *out = e->blob ? msgbuf_ref(e->blob) : NULL;
+    hist_trim(cache_budget);
+    pthread_mutex_unlock(&hist_mutex);
+    return out;
+}
+
+
+/*
+ * Sessions and replay suppression.
+ * A session outlives its connection (keyed by user id, kept SESSION_TTL
+ * seconds after the last disconnect) so a client that reconnects and resends
+ * hits the same dedup window: a ring of the last DEDUP_WINDOW message ids
+ * mirrored in an open-addressed set, both fixed size, so the check is O(1).
+ *
+ * The session also makes delivery at-least-once. Every D_MSG/D_PRIV frame
+ * sent to its connection is numbered (implicitly: the client counts them
+ * too) and a ref to the shared buffer goes into a ring of ACK_WINDOW slots.
+ * The client acks the count it has received every so often (F_ACK) and the
+ * ring drops what is covered. A reconnect gets D_SESSION and the unacked
+ * frames again; the client skips the ones it already had. A client that
+ * never acks only costs the ring: when it is full the oldest frame goes.
+ */
+struct session {
+    pthread_mutex_t lock;
+    uint32_t uid;
+    int active;
+    uint64_t idle_since;    // mono_ms()
+    uint64_t ring[DEDUP_WINDOW];
+    int head, count;
+    uint64_t set[DEDUP_SLOTS];   // 0 = empty slot
+    uint64_t epoch;         // tells a client whether its count still applies
+    client_t *owner;        // the connection whose frames are numbered
+    msgbuf_t *win[ACK_WINDOW];
+    uint64_t win_base;      // number of win[win_head]
+    int win_head, win_count;
+};
+
+session_t *sessions[MAX_SESSIONS];
+pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t dedup_slot(uint64_t id) {
+    id ^= id >> 33; id *= 0xff51afd7ed558ccdULL; id ^= id >> 33;
+    return (uint32_t)id & (DEDUP_SLOTS-1);
+}
+
+int dedup_find(session_t *s, uint64_t id) {
+    for (uint32_t i = dedup_slot(id); s->set[i]; i = (i+1) & (DEDUP_SLOTS-1)) {
+        if (s->set[i] == id) return i;
+    }
+    return -1;
+}
+
+// linear-probe delete with backward shift, so no tombstones accumulate
+void dedup_remove(session_t *s, uint64_t id) {
+    int i = dedup_find(s, id);
+    if (i < 0) return;
+    uint32_t hole = i;
+    for (uint32_t j = (hole+1) & (DEDUP_SLOTS-1); s->set[j]; j = (j+1) & (DEDUP_SLOTS-1)) {
+        uint32_t home = dedup_slot(s->set[j]);
+        // move j into the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & (DEDUP_SLOTS-1)) >= ((j - hole) & (DEDUP_SLOTS-1))) {
+            s->set[hole] = s->set[j];
+            hole = j;
+        }
+    }
+    s->set[hole] = 0;
+}
+
+// returns 1 if id was already seen in this session's window
+int session_seen(session_t *s, uint64_t id) {
+    if (id == 0) return 0;
+    pthread_mutex_lock(&s->lock);
+    if (dedup_find(s, id) >= 0) { pthread_mutex_unlock(&s->lock); return 1; }
+    if (s->count == DEDUP_WINDOW) {
+        dedup_remove(s, s->ring[s->head]);
+        s->head = (s->head + 1) % DEDUP_WINDOW;
+        s->count--;
+    }
+    s->ring[(s->head + s->count) % DEDUP_WINDOW] = id;
+    s->count++;
+    uint32_t i = dedup_slot(id);
+    while (s->set[i]) i = (i+1) & (DEDUP_SLOTS-1);
+    s->set[i] = id;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+// a message session_seen let through was dropped after all (rate limit,
+// shedding, no buffer): forget its id so the client's resend gets in
+void session_forget(session_t *s, uint64_t id) {
+    if (id == 0) return;
+    pthread_mutex_lock(&s->lock);
+    if (dedup_find(s, id) >= 0) {
+        dedup_remove(s, id);
+        // almost always the newest entry; otherwise close the gap in the ring
+        for (int k = s->count - 1; k >= 0; k--) {
+            if (s->ring[(s->head + k) % DEDUP_WINDOW] != id) continue;
+            for (; k < s->count - 1; k++) {
+                s->ring[(s->head + k) % DEDUP_WINDOW] = s->ring[(s->head + k + 1) % DEDUP_WINDOW];
+            }
+            s->count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+session_t *session_attach(uint32_t uid) {
+    session_t *s = NULL;
+    int free_slot = -1;
+    pthread_mutex_lock(&sessions_mutex);
+    for (int i=0;i<MAX_SESSIONS;i++) {
+        if (!sessions[i]) { if (free_slot < 0) free_slot = i; continue; }
+        if (sessions[i]->uid == uid) { s = sessions[i]; break; }
+    }
+    if (!s && free_slot >= 0 && (s = calloc(1, sizeof(*s)))) {
+        pthread_mutex_init(&s->lock, NULL);
+        s->uid = uid;
+        intern_ref(uid);
+        // unique across restarts too, so a client never resumes the wrong count
+        s->epoch = real_us() << 12 | (free_slot & 0xfff);
+        sessions[free_slot] = s;
+        mem_charge(MEM_CONN, sizeof(*s));
+    }
+    if (s) s->active++;
+    pthread_mutex_unlock(&sessions_mutex);
+    return s;
+}
+
+// caller holds s->lock; returns bytes given back
+size_t session_trim(session_t *s, uint64_t upto) {
+    size_t freed = 0;
+    while (s->win_count > 0 && s->win_base < upto) {
+        msgbuf_t *b = s->win[s->win_head];
+        freed += sizeof(msgbuf_t) + b->cap;
+        msgbuf_unref(b);
+        s->win_head = (s->win_head + 1) % ACK_WINDOW;
+        s->win_base++;
+        s->win_count--;
+        atomic_fetch_sub_explicit(&stat_unacked, 1, memory_order_relaxed);
+    }
+    return freed;
+}
+
+// b goes to cli's socket; numbered and held if cli owns its session.
+// Caller holds clients_mutex (or is cli's own thread), so cli->sess is stable.
+void deliver(client_t *cli, msgbuf_t *b) {
+    session_t *s = cli->sess;
+    if (s) {
+        pthread_mutex_lock(&s->lock);
+        if (s->owner == cli) {
+            if (s->win_count == ACK_WINDOW) session_trim(s, s->win_base + 1);
+            s->win[(s->win_head + s->win_count) % ACK_WINDOW] = msgbuf_ref(b);
+            s->win_count++;
+            atomic_fetch_add_explicit(&stat_unacked, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    send_buf(cli->sock, b);
+}
+
+// F_ACK: the client has received upto frames of this session
+void session_ack(client_t *cli, uint64_t upto) {
+    session_t *s = cli->sess;
+    pthread_mutex_lock(&s->lock);
+    if (s->owner == cli) session_trim(s, upto);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Make cli the connection of its session: send D_SESSION, then everything
+ * the previous connection never acked. Runs before cli is visible to
+ * fan-out, so nothing new can slip in between. What the room said while
+ * nobody was connected comes with the room history, as for any joiner.
+ */
+void session_resume(client_t *cli) {
+    session_t *s = cli->sess;
+    msgbuf_t *replay[ACK_WINDOW];
+    char out[sizeof(down_hdr_t) + 16];
+    pthread_mutex_lock(&s->lock);
+    s->owner = cli;
+    size_t h = put_down_hdr(out, D_SESSION, 0, UID_SERVER, 16);
+    put_be64(out + h, s->epoch);
+    put_be64(out + h + 8, s->win_base);
+    int n = s->win_count;
+    for (int i=0;i<n;i++) replay[i] = msgbuf_ref(s->win[(s->win_head + i) % ACK_WINDOW]);
+    pthread_mutex_unlock(&s->lock);
+    // sent outside the lock: a slow reader must not stall fan-out
+    send_bytes(cli->sock, out, h + 16);
+    for (int i=0;i<n;i++) {
+        send_buf(cli->sock, replay[i]);
+        msgbuf_unref(replay[i]);
+    }
+}
+
+// under pressure, idle sessions give up their unacked frames first
+size_t session_shrink(size_t want) {
+    size_t freed = 0;
+    if (pthread_mutex_trylock(&sessions_mutex) != 0) return 0;
+    for (int i=0;i<MAX_SESSIONS && freed < want;i++) {
+        session_t *s = sessions[i];
+        if (!s || s->active || pthread_mutex_trylock(&s->lock) != 0) continue;
+        freed += session_trim(s, s->win_base + s->win_count);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return freed;
+}
+
+void session_detach(session_t *s, client_t *cli) {
+    pthread_mutex_lock(&s->lock);
+    if (s->owner == cli) s->owner = NULL;
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_lock(&sessions_mutex);
+    if (--s->active == 0) s->idle_since = mono_ms();
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+// called from the tick: forget sessions idle for longer than SESSION_TTL
+void session_expire() {
+    uint64_t now = mono_ms();
+    pthread_mutex_lock(&sessions_mutex);
+    for (int i=0;i<MAX_SESSIONS;i++) {
+        session_t *s = sessions[i];
+        if (s && s->active == 0 && now - s->idle_since > (uint64_t)SESSION_TTL * 1000) {
+            sessions[i] = NULL;
+            session_trim(s, s->win_base + s->win_count);
+            pthread_mutex_destroy(&s->lock);
+            intern_unref(s->uid);
+            free(s);
+            mem_release(MEM_CONN, sizeof(*s));
+        }
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+/*
+ * LAN multicast (-M). Every room message is also sent once, as a datagram,
+ * to one multicast group: u32 stream id, then the D_MSG frame exactly as
+ * TCP would carry it. A client that joined the group says so (F_MCAST);
+ * from then on fan-out skips it and it gets D_MCBASE, the room seq the
+ * datagrams continue from, on every room switch. Gaps in the seqs are
+ * NACKed (F_NACK) and answered over TCP from a per-room ring of the last
+ * MC_RING messages. Rooms that spoke recently re-announce their latest seq
+ * by datagram each tick, so a lost last message is noticed too, and the
+ * lobby does every MC_KEEPALIVE_MS when nothing else went out: clients only
+ * switch to multicast once a datagram arrived, and go back to TCP (F_MCAST
+ * with the room seq they got to, repaired from there) when they stop.
+ * Server egress per message is one sendmsg however many listen on the LAN.
+ */
+int mc_fd = -1;
+struct sockaddr_in mc_addr;
+uint32_t mc_iface;              // host order, 0 = the routing table's choice
+uint32_t mc_stream;             // tells this server's datagrams from others'
+msgbuf_t **mc_ring[MAX_ROOMS];  // seq % MC_RING, guarded by clients_mutex
+int mc_quiet[MAX_ROOMS];        // heartbeats left, guarded by clients_mutex
+atomic_ulong stat_mc_sent, stat_mc_repaired;
+atomic_ullong mc_last_ms;       // mono_ms of the last datagram
+
+void mc_open(const char *spec) {
+    char group[48], iface[48] = "";
+    int port;
+    if (sscanf(spec, "%47[^:]:%d,%47s", group, &port, iface) < 2) { fprintf(stderr, "-M: need group:port[,ifaddr]\n"); exit(1); }
+    memset(&mc_addr, 0, sizeof(mc_addr));
+    mc_addr.sin_family = AF_INET;
+    mc_addr.sin_port = htons(port);
+    struct in_addr ifa = { htonl(INADDR_ANY) };
+    if (inet_pton(AF_INET, group, &mc_addr.sin_addr) != 1 || !IN_MULTICAST(ntohl(mc_addr.sin_addr.s_addr)) ||
+        (iface[0] && inet_pton(AF_INET, iface, &ifa) != 1)) {
+        fprintf(stderr, "-M: %s is not a multicast group (or bad interface address)\n", group);
+        exit(1);
+    }
+    if ((mc_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) { perror("socket"); exit(1); }
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(mc_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(mc_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (iface[0] && setsockopt(mc_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifa, sizeof(ifa)) < 0) { perror("IP_MULTICAST_IF"); exit(1); }
+    mc_iface = ntohl(ifa.s_addr);
+    mc_stream = (uint32_t)real_us() ^ ((uint32_t)getpid() << 16);
+}
+
+void mc_send(const void *p, size_t n) {
+    uint32_t id = htonl(mc_stream);
+    struct iovec iov[2] = { { &id, 4 }, { (void*)p, n } };
+    struct msghdr m = { .msg_name = &mc_addr, .msg_namelen = sizeof(mc_addr), .msg_iov = iov, .msg_iovlen = 2 };
+    if (sendmsg(mc_fd, &m, 0) < 0) perror("multicast");
+    else stat_add(&stat_mc_sent, 1);
+    atomic_store(&mc_last_ms, mono_ms());
+}
+
+// caller holds clients_mutex; b is the room's D_MSG frame, already numbered
+void mc_publish(int room, uint32_t seq, msgbuf_t *b) {
+    if (!mc_ring[room] && !(mc_ring[room] = calloc(MC_RING, sizeof(msgbuf_t*)))) return;
+    msgbuf_t **slot = &mc_ring[room][seq % MC_RING];
+    if (*slot) msgbuf_unref(*slot);
+    *slot = msgbuf_ref(b);
+    mc_quiet[room] = MC_HEARTBEATS;
+    mc_send(b->data, b->len);
+}
+
+// D_MCBASE: room messages after seq come by multicast
+void mc_send_base(client_t *cli, int room, uint32_t seq) {
+    char out[sizeof(down_hdr_t) + 4];
+    size_t n = put_down_hdr(out, D_MCBASE, room, UID_SERVER, 4);
+    uint32_t v = htonl(seq);
+    memcpy(out + n, &v, 4);
+    send_bytes(cli->sock, out, n + 4);
+}
+
+// F_MCAST (empty): the client gets our datagrams
+void mc_enable(client_t *cli) {
+    if (mc_fd < 0) return;
+    pthread_mutex_lock(&clients_mutex);
+    int room = cli->room;
+    uint32_t seq = room_seq[room];
+    if (!cli->mcast) atomic_fetch_add_explicit(&stat_mcast, 1, memory_order_relaxed);
+    cli->mcast = 1;
+    pthread_mutex_unlock(&clients_mutex);
+    mc_send_base(cli, room, seq);
+}
+
+// room seqs first..last (clamped to what exists) as D_MSG with D_OFFSTREAM
+void mc_resend(client_t *cli, int room, uint32_t first, uint32_t last) {
+    if (room >= MAX_ROOMS || first == 0) return;
+    msgbuf_t *got[MC_RING];
+    int n = 0;
+    uint32_t lost = 0;
+    pthread_mutex_lock(&clients_mutex);
+    if (last > room_seq[room]) last = room_seq[room];
+    if (last >= first && last - first >= MC_RING) { lost = last - first + 1 - MC_RING; first = last - MC_RING + 1; }
+    for (uint32_t seq = first; seq <= last && seq != 0; seq++) {
+        msgbuf_t *b = mc_ring[room] ? mc_ring[room][seq % MC_RING] : NULL;
+        msg_meta_t m;
+        if (b) memcpy(&m, b->data + sizeof(down_hdr_t), sizeof(m));
+        if (b && ntohl(m.seq) == seq) got[n++] = msgbuf_ref(b);
+        else lost++;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    for (int i=0;i<n;i++) {
+        char out[sizeof(down_hdr_t) + sizeof(msg_meta_t) + BUF_SIZE];
+        size_t len = got[i]->len < sizeof(out) ? got[i]->len : sizeof(out);
+        memcpy(out, got[i]->data, len);
+        ((down_hdr_t*)out)->flags |= D_OFFSTREAM;
+        send_bytes(cli->sock, out, len);
+        msgbuf_unref(got[i]);
+    }
+    stat_add(&stat_mc_repaired, n);
+    if (lost) {
+        char line[64];
+        snprintf(line, sizeof(line), "*** %u messages lost (too old to repair)\n", lost);
+        send_to_sock(cli->sock, line);
+    }
+}
+
+// F_NACK: u16 room, u32 first, u32 last seq missing
+void mc_repair(client_t *cli, const char *p) {
+    uint16_t room;
+    uint32_t first, last;
+    memcpy(&room, p, 2);
+    memcpy(&first, p + 2, 4);
+    memcpy(&last, p + 6, 4);
+    mc_resend(cli, ntohs(room), ntohl(first), ntohl(last));
+}
+
+// F_MCAST with u16 room, u32 seq: datagrams stopped reaching the client, which
+// got that room as far as seq; TCP from now on, and whatever came after seq
+void mc_disable(client_t *cli, const char *p) {
+    uint16_t room;
+    uint32_t seq;
+    memcpy(&room, p, 2);
+    memcpy(&seq, p + 2, 4);
+    room = ntohs(room); seq = ntohl(seq);
+    pthread_mutex_lock(&clients_mutex);
+    if (cli->mcast) atomic_fetch_sub_explicit(&stat_mcast, 1, memory_order_relaxed);
+    cli->mcast = 0;
+    // fan-out includes it again from here: everything up to last is the repair's
+    uint32_t last = room_seq[cli->room];
+    int same = room == cli->room;
+    pthread_mutex_unlock(&clients_mutex);
+    if (same && seq < last) mc_resend(cli, room, seq + 1, last);
+}
+
+// from the tick: rooms that spoke lately repeat their latest seq, and the
+// lobby keeps the stream alive
+void mc_heartbeat() {
+    if (mc_fd < 0) return;
+    char out[MAX_ROOMS][sizeof(down_hdr_t) + 4];
+    int n = 0;
+    int idle = mono_ms() - atomic_load(&mc_last_ms) >= MC_KEEPALIVE_MS;
+    pthread_mutex_lock(&clients_mutex);
+    for (int r=0;r<MAX_ROOMS;r++) {
+        if (!mc_quiet[r] && !(r == 0 && idle)) continue;
+        if (mc_quiet[r]) mc_quiet[r]--;
+        size_t h = put_down_hdr(out[n], D_MCBASE, r, UID_SERVER, 4);
+        uint32_t v = htonl(room_seq[r]);
+        memcpy(out[n] + h, &v, 4);
+        n++;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    for (int i=0;i<n;i++) mc_send(out[i], sizeof(out[i]));
+}
+
+/*
+ * Presence batching.
+ * Joins and leaves are queued per room and flushed once per tick: members
+ * get one D_DELTA frame plus one combined notice, members who joined during
+ * the tick get a full D_USERS list instead (built once per room). A join and
+ * leave of the same user inside one tick cancel out.
+ */
+typedef struct {
+    uint32_t uid;
+    int join;
+} presence_ev_t;
+
+typedef struct {
+    presence_ev_t *ev;
+    int n, cap;
+    int dirty;
+} room_delta_t;
+
+room_delta_t deltas[MAX_ROOMS];
+pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void presence_event(int room, uint32_t uid, int join) {
+    pthread_mutex_lock(&presence_mutex);
+    room_delta_t *d = &deltas[room];
+    d->dirty = 1;
+    for (int i=0;i<d->n;i++) {
+        if (d->ev[i].join != join && d->ev[i].uid == uid) {
+            d->ev[i] = d->ev[--d->n];
+            atomic_fetch_sub_explicit(&stat_presence, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&presence_mutex);
+            return;
+        }
+    }
+    if (d->n == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 16;
+        presence_ev_t *ev = realloc(d->ev, cap * sizeof(*ev));
+        if (!ev) { pthread_mutex_unlock(&presence_mutex); return; }
+        d->ev = ev;
+        d->cap = cap;
+    }
+    d->ev[d->n].uid = uid;
+    d->ev[d->n].join = join;
+    d->n++;
+    atomic_fetch_add_explicit(&stat_presence, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+// "*** a, b joined; c left" (capped at NOTICE_NAMES names per side)
+int format_notice(char *out, size_t cap, const presence_ev_t *ev, int n) {
+    size_t len = snprintf(out, cap, "***");
+    int parts = 0;
+    for (int join=1; join>=0; join--) {
+        int shown = 0, total = 0;
+        for (int i=0;i<n;i++) {
+            if (ev[i].join != join) continue;
+            if (shown < NOTICE_NAMES) {
+                len += snprintf(out+len, cap-len, "%s %s", shown ? "," : (parts ? ";" : ""), uid_name(ev[i].uid));
+                shown++;
+            }
+            total++;
+        }
+        if (!total) continue;
+        if (total > shown) len += snprintf(out+len, cap-len, " and %d more", total - shown);
+        len += snprintf(out+len, cap-len, join ? " joined" : " left");
+        parts++;
+    }
+    return len;
+}
+
+// the notice rides in the same buffer, as a D_TEXT line
+size_t put_notice(char *p, int room, const char *notice, size_t nlen) {
+    if (!nlen) return 0;
+    size_t h = put_down_hdr(p, D_TEXT, room, UID_SERVER, nlen);
+    memcpy(p + h, notice, nlen);
+    return h + nlen;
+}
+
+// caller holds clients_mutex; the room's list is built once per flush
+msgbuf_t *build_userlist(int room, const char *notice, size_t nlen) {
+    uint32_t count = 0;
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (clients[i] && clients[i]->room == room && clients[i]->uid != UID_NONE) count++;
+    }
+    msgbuf_t *b = msgbuf_alloc(2*sizeof(down_hdr_t) + count*4 + nlen, PRIO_LOW);
+    if (!b) return NULL;
+    b->len = put_down_hdr(b->data, D_USERS, room, UID_SERVER, count*4);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (clients[i] && clients[i]->room == room && clients[i]->uid != UID_NONE) {
+            uint32_t v = htonl(clients[i]->uid);
+            memcpy(b->data + b->len, &v, 4);
+            b->len += 4;
+        }
+    }
+    b->len += put_notice(b->data + b->len, room, notice, nlen);
+    return b;
+}
+
+void presence_flush_room(int room, presence_ev_t *ev, int n) {
+    char notice[NOTICE_NAMES*2*(NAME_LEN+2) + 64];
+    size_t nlen = 0;
+    // the delta itself is never shed: dropping it would leave stale lists
+    if (n > 0 && !should_shed(PRIO_LOW)) nlen = format_notice(notice, sizeof(notice), ev, n);
+    msgbuf_t *delta = msgbuf_alloc(2*sizeof(down_hdr_t) + n*4 + nlen, PRIO_LOW);
+    if (!delta) return;
+    if (n > 0) {
+        delta->len = put_down_hdr(delta->data, D_DELTA, room, UID_SERVER, n*4);
+        for (int i=0;i<n;i++) {
+            uint32_t v = htonl(ev[i].uid | (ev[i].join ? 0 : DELTA_LEAVE));
+            memcpy(delta->data + delta->len, &v, 4);
+            delta->len += 4;
+        }
+        delta->len += put_notice(delta->data + delta->len, room, notice, nlen);
+    }
+    msgbuf_t *list = NULL;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        client_t *c = clients[i];
+        if (!c || c->room != room || c->uid == UID_NONE) continue;
+        if (c->need_list) {
+            if (!list) list = build_userlist(room, notice, nlen);
+            if (list) send_buf(c->sock, list);
+            c->need_list = 0;
+        } else if (delta->len) {
+            send_buf(c->sock, delta);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (nlen) log_msg(now_ms(), room, UID_SERVER, BL_NOTICE, NULL, 0, notice, nlen);
+    if (list) msgbuf_unref(list);
+    msgbuf_unref(delta);
+}
+
+void presence_flush() {
+    for (int r=0;r<MAX_ROOMS;r++) {
+        pthread_mutex_lock(&presence_mutex);
+        room_delta_t d = deltas[r];
+        if (!d.dirty) { pthread_mutex_unlock(&presence_mutex); continue; }
+        deltas[r].ev = NULL;
+        deltas[r].n = deltas[r].cap = deltas[r].dirty = 0;
+        atomic_fetch_sub_explicit(&stat_presence, d.n, memory_order_relaxed);
+        pthread_mutex_unlock(&presence_mutex);
+        presence_flush_room(r, d.ev, d.n);
+        free(d.ev);
+    }
+}
+
+void *tick_thread(void *arg) {
+    (void)arg;
+    struct timespec ts = { 0, TICK_MS * 1000000L };
+    while (1) {
+        nanosleep(&ts, NULL);
+        presence_flush();
+        session_expire();
+        hh_rotate();
+        mc_heartbeat();
+        log_flush();
+    }
+    return NULL;
+}
+
+/*
+ * Relays. A relay (-U) subscribes to the server above it over one
+ * connection and re-fans what arrives out to its own clients and relays,
+ * so a server sends each message once per relay instead of once per user,
+ * and a tree of relays needs O(fan-in) sends per hop. The relay stream
+ * carries names rather than ids: every tier keeps its own ids, rooms,
+ * history and sessions and just calls broadcast() with what arrives.
+ * Its clients' messages travel up the same way to the origin, which
+ * stamps, logs and orders them like any other.
+ */
+int relay_fds[MAX_RELAYS];  // downstream relays, guarded by clients_mutex
+int nrelay_fds;
+int relay_depth;            // hops below the origin (0 = we are it)
+char up_host[48];           // -U
+int up_port;
+int upstream_fd = -1;
+pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// D_RELAY / F_RELAYED payload: u8 len, room, u8 len, sender, u64 ts, text
+size_t put_relay(char *p, const char *room, const char *name, uint64_t ts, const char *text, size_t n) {
+    size_t rl = strlen(room), nl = strlen(name), k = 0;
+    p[k++] = rl;
+    memcpy(p + k, room, rl);
+    k += rl;
+    p[k++] = nl;
+    memcpy(p + k, name, nl);
+    k += nl;
+    put_be64(p + k, ts);
+    k += 8;
+    memcpy(p + k, text, n);
+    return k + n;
+}
+
+// text points into p, which the frame reader NUL-terminated
+int get_relay(const char *p, size_t len, char *room, char *name, uint64_t *ts, const char **text) {
+    size_t k = 0, rl, nl;
+    if (len < 1 || (rl = (uint8_t)p[k++]) >= ROOM_LEN || k + rl + 1 > len) return -1;
+    memcpy(room, p + k, rl);
+    room[rl] = '\0';
+    k += rl;
+    if ((nl = (uint8_t)p[k++]) == 0 || nl >= NAME_LEN || k + nl + 8 > len) return -1;
+    memcpy(name, p + k, nl);
+    name[nl] = '\0';
+    k += nl;
+    *ts = get_be64(p + k);
+    *text = p + k + 8;
+    return 0;
+}
+
+// returns the message's seq, 0 if it was shed
+uint32_t broadcast(int room, uint32_t sender, const char *msg, int prio, uint64_t ts) {
+    if (should_shed(prio)) return 0;
+    size_t n = strlen(msg);
+    msgbuf_t *b = msgbuf_alloc(sizeof(down_hdr_t) + sizeof(msg_meta_t) + n, prio);
+    if (!b) return 0;
+    size_t h = put_down_hdr(b->data, D_MSG, room, sender, sizeof(msg_meta_t) + n);
+    b->len = h + sizeof(msg_meta_t);
+    memcpy(b->data + b->len, msg, n);
+    b->len += n;
+    // one more encoding for relays below us (by name), shared by all of them
+    msgbuf_t *rb = NULL;
+    if (prio == PRIO_NORMAL && nrelay_fds &&
+        (rb = msgbuf_alloc(sizeof(down_hdr_t) + 2 + ROOM_LEN + NAME_LEN + 8 + n, prio))) {
+        rb->len = sizeof(down_hdr_t) + put_relay(rb->data + sizeof(down_hdr_t), room_names[room], uid_name(sender), ts, msg, n);
+        put_down_hdr(rb->data, D_RELAY, 0, UID_SERVER, rb->len - sizeof(down_hdr_t));
+        ((down_hdr_t*)rb->data)->flags = relay_depth;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    // numbered under the lock, so seq order is delivery order
+    uint32_t seq = ++room_seq[room];
+    put_msg_meta(b->data + h, seq, ts);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (clients[i] && clients[i]->room == room && clients[i]->uid != UID_NONE && !clients[i]->mcast) {
+            deliver(clients[i], b);
+        }
+    }
+    if (mc_fd >= 0) mc_publish(room, seq, b);
+    spec_fanout(room, b->data, b->len);
+    for (int i=0;i<nrelay_fds && rb;i++) send_buf(relay_fds[i], rb);
+    pthread_mutex_unlock(&clients_mutex);
+    if (rb) msgbuf_unref(rb);
+    // notices are not worth replaying to joiners
+    if (prio != PRIO_LOW) hist_append(room, b);
+    log_msg(ts, room, sender, prio == PRIO_LOW ? BL_NOTICE : 0, NULL, 0, msg, n);
+    msgbuf_unref(b);
+    return seq;
+}
+
+void send_history(client_t *cli) {
+    msgbuf_t *h = hist_get(cli->room);
+    if (!h) return;
+    send_buf(cli->sock, h);
+    msgbuf_unref(h);
+}
+
+// caller holds clients_mutex
+client_t *find_by_uid(uint32_t uid) {
+    return uid < atomic_load(&nnames) ? intern_tab[uid].conn : NULL;
+}
+
+/*
+ * Private and group messages. Targets are resolved in one pass over the
+ * intern index and one pass under clients_mutex; the D_PRIV frame (target
+ * ids, no names) is encoded and logged once, then sent once to each
+ * distinct recipient and the sender.
+ */
+// returns the message's seq, 0 if nothing was sent
+uint32_t send_private(client_t *cli, const char *spec, uint64_t ts) {
+    char targets[MAX_DM_TARGETS][NAME_LEN];
+    uint32_t tuids[MAX_DM_TARGETS];
+    int nt = 0;
+    const char *p = spec;
+    while (*p && *p != ' ' && nt < MAX_DM_TARGETS) {
+        int j = 0;
+        while (*p && *p != ' ' && *p != ',') {
+            if (j < NAME_LEN-1) targets[nt][j++] = *p;
+            p++;
+        }
+        targets[nt][j] = '\0';
+        if (j > 0) nt++;
+        if (*p == ',') p++;
+    }
+    while (*p && *p != ' ') p++;    // more targets than we take
+    if (*p == ' ') p++;
+    const char *message = p;
+    if (nt == 0) return 0;
+
+    intern_find_many(targets, nt, tuids);
+    // drop unknown names (reporting them) and duplicates
+    char missing[BUF_SIZE] = "";
+    int k = 0;
+    for (int i=0;i<nt;i++) {
+        int dup = 0;
+        for (int j=0;j<k;j++) if (tuids[j] == tuids[i]) dup = 1;
+        if (tuids[i] == UID_NONE) {
+            size_t m = strlen(missing);
+            snprintf(missing + m, sizeof(missing) - m, "%s%s", m ? ", " : "", targets[i]);
+        } else if (!dup) {
+            tuids[k++] = tuids[i];
+        }
+    }
+    if (missing[0]) {
+        char err[BUF_SIZE + 32];
+        snprintf(err, sizeof(err), "*** no such user: %s\n", missing);
+        send_to_sock(cli->sock, err);
+    }
+    if (k == 0) return 0;
+
+    size_t mlen = strlen(message);
+    // a pooled buffer rather than the stack: recipients' sessions hold refs to it
+    msgbuf_t *b = msgbuf_alloc(sizeof(down_hdr_t) + sizeof(msg_meta_t) + k*4 + mlen, PRIO_NORMAL);
+    if (!b) return 0;
+    char *out = b->data;
+    size_t h = put_down_hdr(out, D_PRIV, 0, cli->uid, sizeof(msg_meta_t) + k*4 + mlen);
+    ((down_hdr_t*)out)->flags = k;
+    size_t n = h + sizeof(msg_meta_t);
+    for (int i=0;i<k;i++) {
+        uint32_t v = htonl(tuids[i]);
+        memcpy(out + n, &v, 4);
+        n += 4;
+    }
+    memcpy(out + n, message, mlen);
+    b->len = n + mlen;
+    log_msg(ts, 0, cli->uid, BL_PRIVATE, tuids, k, message, mlen);
+
+    pthread_mutex_lock(&clients_mutex);
+    uint32_t seq = ++dm_seq;
+    put_msg_meta(out + h, seq, ts);
+    for (int i=0;i<k;i++) {
+        client_t *rcv = find_by_uid(tuids[i]);
+        if (rcv && rcv != cli) deliver(rcv, b);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    deliver(cli, b);
+    msgbuf_unref(b);
+    return seq;
+}
+
+// returns -1 when every slot is taken
+int add_client(client_t *cl) {
+    int r = -1;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (!clients[i]) {
+            clients[i] = cl;
+            r = 0;
+            atomic_fetch_add_explicit(&stat_clients, 1, memory_order_relaxed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return r;
+}
+
+void remove_client(client_t *cl) {
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        if (clients[i] == cl) {
+            clients[i] = NULL;
+            atomic_fetch_sub_explicit(&stat_clients, 1, memory_order_relaxed);
+            break;
+        }
+    }
+    if (cl->uid != UID_NONE && intern_tab[cl->uid].conn == cl) intern_tab[cl->uid].conn = NULL;
+    if (cl->mcast) atomic_fetch_sub_explicit(&stat_mcast, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&clients_mutex);
+    if (cl->uid != UID_NONE) presence_event(cl->room, cl->uid, 0);
+}
+
+// undo remove_client for a client whose thread keeps running
+int relink_client(client_t *cl) {
+    if (add_client(cl) < 0) return -1;
+    pthread_mutex_lock(&clients_mutex);
+    if (cl->uid != UID_NONE && !intern_tab[cl->uid].conn) intern_tab[cl->uid].conn = cl;
+    if (cl->mcast) atomic_fetch_add_explicit(&stat_mcast, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&clients_mutex);
+    if (cl->uid != UID_NONE) presence_event(cl->room, cl->uid, 1);
+    return 0;
+}
+
+/*
+ * Moderation.
+ * Banned IPv4 ranges live in a binary prefix trie over a fixed node array.
+ * Writers (the console) serialize on ban_mutex and publish a node only after
+ * filling it in, so the accept loop walks it without any lock: at most 32
+ * steps, no allocation, and a banned peer is reset before a client_t or
+ * thread exists for it. Unbanning clears the mark; nodes are not reused.
+ * Name bans are a flag on the interned name, checked at hello.
+ */
+typedef struct {
+    atomic_uint child[2];   // 0 = none (node 0 is the root)
+    atomic_uchar term;      // a banned prefix ends here
+} ban_node_t;
+
+ban_node_t ban_trie[BAN_NODES];
+uint32_t ban_nnodes = 1;
+atomic_ulong ban_rejects;
+pthread_mutex_t ban_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int ip_banned(uint32_t ip) {
+    uint32_t n = 0;
+    for (int i=31;;i--) {
+        if (atomic_load_explicit(&ban_trie[n].term, memory_order_relaxed)) return 1;
+        if (i < 0) return 0;
+        n = atomic_load_explicit(&ban_trie[n].child[(ip >> i) & 1], memory_order_acquire);
+        if (!n) return 0;
+    }
+}
+
+// returns 0, or -1 when the trie is full
+int ban_set(uint32_t ip, int plen, int on) {
+    pthread_mutex_lock(&ban_mutex);
+    uint32_t n = 0;
+    for (int i=0;i<plen;i++) {
+        int bit = (ip >> (31-i)) & 1;
+        uint32_t c = atomic_load(&ban_trie[n].child[bit]);
+        if (!c) {
+            if (!on) { pthread_mutex_unlock(&ban_mutex); return 0; }
+            if (ban_nnodes == BAN_NODES) { pthread_mutex_unlock(&ban_mutex); return -1; }
+            c = ban_nnodes++;
+            atomic_store_explicit(&ban_trie[n].child[bit], c, memory_order_release);
+        }
+        n = c;
+    }
+    atomic_store(&ban_trie[n].term, on);
+    pthread_mutex_unlock(&ban_mutex);
+    return 0;
+}
+
+// "a.b.c.d" or "a.b.c.d/len"; returns 0 on success
+int parse_cidr(const char *s, uint32_t *ip, int *plen) {
+    char addr[INET_ADDRSTRLEN];
+    const char *slash = strchr(s, '/');
+    size_t n = slash ? (size_t)(slash - s) : strlen(s);
+    if (n >= sizeof(addr)) return -1;
+    memcpy(addr, s, n);
+    addr[n] = '\0';
+    struct in_addr a;
+    if (inet_pton(AF_INET, addr, &a) != 1) return -1;
+    *plen = slash ? atoi(slash + 1) : 32;
+    if (*plen < 0 || *plen > 32) return -1;
+    *ip = ntohl(a.s_addr);
+    if (*plen < 32) *ip &= ~(0xffffffffu >> *plen);
+    return 0;
+}
+
+void ban_list(FILE *out, uint32_t n, uint32_t prefix, int depth) {
+    if (atomic_load(&ban_trie[n].term)) {
+        struct in_addr a = { htonl(prefix) };
+        char addr[INET_ADDRSTRLEN];
+        fprintf(out, "  %s/%d\n", inet_ntop(AF_INET, &a, addr, sizeof(addr)), depth);
+    }
+    for (int bit=0;bit<2;bit++) {
+        uint32_t c = atomic_load(&ban_trie[n].child[bit]);
+        if (c) ban_list(out, c, prefix | (uint32_t)bit << (31-depth), depth+1);
+    }
+}
+
+// the owning thread notices the dead socket and does the normal cleanup
+int kick_where(uint32_t uid, uint32_t ip, int plen) {
+    int n = 0;
+    uint32_t mask = plen ? ~(0xffffffffu >> plen) : 0;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++){
+        client_t *c = clients[i];
+        if (!c) continue;
+        if (uid != UID_NONE ? c->uid == uid : (c->ip & mask) == ip) {
+            send_to_sock(c->sock, "*** you have been removed by an admin\n");
+            shutdown(c->sock, SHUT_RDWR);
+            n++;
+        }
+    }
+    // spectators have no name, but an address ban covers them too
+    for (int r=0;r<MAX_ROOMS && uid == UID_NONE;r++) {
+        for (int i=0;i<spec_rooms[r].n;i++) {
+            spectator_t *sp = spec_rooms[r].v[i];
+            if (!sp->dead && (sp->ip & mask) == ip) {
+                spec_cut(sp);
+                n++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return n;
+}
+
+void admin_command(char *line, FILE *out) {
+    char cmd[16], arg[64];
+    line[strcspn(line, "\r\n")] = '\0';
+    int k = sscanf(line, "%15s %63s", cmd, arg);
+    if (k < 1 || cmd[0] == '#') return;
+    uint32_t ip, uid;
+    int plen;
+    if (k == 2 && strcmp(cmd, "kick") == 0) {
+        uid = intern(arg, INTERN_FIND, NULL);
+        fprintf(out, "kicked %d connection(s)\n", uid == UID_NONE ? 0 : kick_where(uid, 0, 0));
+    } else if (k == 2 && (strcmp(cmd, "ban") == 0 || strcmp(cmd, "unban") == 0)) {
+        int on = cmd[0] == 'b';
+        uid = on ? intern_user(arg) : intern(arg, INTERN_FIND, NULL);
+        if (uid == UID_NONE || uid == UID_SERVER) { fprintf(out, "no such user\n"); return; }
+        atomic_store(&intern_tab[uid].banned, on);
+        fprintf(out, "%s %s\n", on ? "banned" : "unbanned", arg);
+        if (on) kick_where(uid, 0, 0);
+    } else if (k == 2 && (strcmp(cmd, "banip") == 0 || strcmp(cmd, "unbanip") == 0)) {
+        int on = cmd[0] == 'b';
+        if (parse_cidr(arg, &ip, &plen) < 0) { fprintf(out, "bad address: %s\n", arg); return; }
+        if (ban_set(ip, plen, on) < 0) { fprintf(out, "ban table full\n"); return; }
+        fprintf(out, "%s %s\n", on ? "banned" : "unbanned", arg);
+        if (on) kick_where(UID_NONE, ip, plen);
+    } else if (strcmp(cmd, "top") == 0) {
+        pthread_mutex_lock(&hh_snap_mutex);
+        fprintf(out, "last %ds window, count (+max overcount):\n", HH_WINDOW_MS / 1000);
+        for (int i=0;i<snap_ntalkers;i++) {
+            fprintf(out, "  %-20s %u (+%u)\n", uid_name(snap_talkers[i].key), snap_talkers[i].count, snap_talkers[i].err);
+        }
+        for (int i=0;i<snap_nrooms;i++) {
+            fprintf(out, "  #%-19s %u (+%u)\n", room_names[snap_rooms[i].key], snap_rooms[i].count, snap_rooms[i].err);
+        }
+        pthread_mutex_unlock(&hh_snap_mutex);
+    } else if (strcmp(cmd, "bans") == 0) {
+        fprintf(out, "names:\n");
+        uint32_t n = atomic_load(&nnames);
+        for (uint32_t i=0;i<n;i++) if (atomic_load(&intern_tab[i].banned)) fprintf(out, "  %s\n", intern_tab[i].name);
+        fprintf(out, "addresses:\n");
+        ban_list(out, 0, 0, 0);
+        fprintf(out, "rejected at accept: %lu\n", atomic_load(&ban_rejects));
+    } else {
+        fprintf(out, "commands: kick <name> | ban <name> | unban <name> | "
+                     "banip <a.b.c.d[/len]> | unbanip <a.b.c.d[/len]> | bans | top\n");
+    }
+    fflush(out);
+}
+
+void *console_thread(void *arg) {
+    (void)arg;
+    char line[256];
+    while (fgets(line, sizeof(line), stdin)) admin_command(line, stdout);
+    return NULL;
+}
+
+void load_bans(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); exit(1); }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) admin_command(line, stdout);
+    fclose(f);
+}
+
+/*
+ * Connections per peer address (pending and logged in), an open-addressed
+ * table with the same backward-shift delete as the dedup set. It holds at
+ * most MAX_CLIENTS + MAX_PENDING addresses, so it never fills.
+ */
+typedef struct {
+    uint32_t ip;
+    uint32_t n;     // 0 = empty slot
+} ip_slot_t;
+
+ip_slot_t ip_tab[IP_SLOTS];
+int max_per_ip = MAX_PER_IP;
+pthread_mutex_t ip_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t ip_home(uint32_t ip) {
+    ip *= 0x9e3779b1u;
+    return (ip >> 16) & (IP_SLOTS-1);
+}
+
+// returns 0 and counts the connection, -1 if the address is at its cap
+int ip_acquire(uint32_t ip) {
+    pthread_mutex_lock(&ip_mutex);
+    uint32_t i = ip_home(ip);
+    while (ip_tab[i].n && ip_tab[i].ip != ip) i = (i+1) & (IP_SLOTS-1);
+    int r = -1;
+    if ((int)ip_tab[i].n < max_per_ip) {
+        ip_tab[i].ip = ip;
+        ip_tab[i].n++;
+        r = 0;
+    }
+    pthread_mutex_unlock(&ip_mutex);
+    return r;
+}
+
+void ip_release(uint32_t ip) {
+    pthread_mutex_lock(&ip_mutex);
+    uint32_t i = ip_home(ip);
+    while (ip_tab[i].n && ip_tab[i].ip != ip) i = (i+1) & (IP_SLOTS-1);
+    if (ip_tab[i].n && --ip_tab[i].n == 0) {
+        uint32_t hole = i;
+        for (uint32_t j = (hole+1) & (IP_SLOTS-1); ip_tab[j].n; j = (j+1) & (IP_SLOTS-1)) {
+            uint32_t home = ip_home(ip_tab[j].ip);
+            if (((j - home) & (IP_SLOTS-1)) >= ((j - hole) & (IP_SLOTS-1))) {
+                ip_tab[hole] = ip_tab[j];
+                hole = j;
+            }
+        }
+        ip_tab[hole].n = 0;
+    }
+    pthread_mutex_unlock(&ip_mutex);
+}
+
+void client_free(client_t *cli) {
+    close(cli->sock);
+    ip_release(cli->ip);
+    intern_unref(cli->login_uid);
+    free(cli);
+    mem_release(MEM_CONN, CONN_COST);
+}
+
+int spec_ep = -1;
+
+void spec_free(spectator_t *sp) {
+    pthread_mutex_lock(&clients_mutex);
+    spec_list_t *l = &spec_rooms[sp->room];
+    l->v[sp->slot] = l->v[--l->n];
+    l->v[sp->slot]->slot = sp->slot;
+    pthread_mutex_unlock(&clients_mutex);
+    epoll_ctl(spec_ep, EPOLL_CTL_DEL, sp->fd, NULL);
+    close(sp->fd);
+    ip_release(sp->ip);
+    for (int i=0;i<sp->njoin;i++) msgbuf_unref(sp->join[i]);
+    free(sp->pend);
+    free(sp);
+    mem_release(MEM_CONN, SPEC_COST);
+    atomic_fetch_sub_explicit(&stat_spectators, 1, memory_order_relaxed);
+}
+
+// write join data, then the live frames queued behind it, as far as the socket takes them;
+// caller holds clients_mutex
+void spec_flush(spectator_t *sp) {
+    while (sp->joining && !sp->dead) {
+        const char *p;
+        size_t n;
+        if (sp->njoin) { p = sp->join[0]->data; n = sp->join[0]->len; }
+        else if (sp->plen) { p = sp->pend; n = sp->plen; }
+        else {
+            sp->joining = 0;
+            free(sp->pend);
+            sp->pend = NULL;
+            sp->pcap = 0;
+            break;
+        }
+        ssize_t w = send(sp->fd, p + sp->off, n - sp->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) spec_cut(sp);
+            break;
+        }
+        stat_add(&stat_bytes_out, w);
+        sp->off += w;
+        if (sp->off < n) continue;
+        sp->off = 0;
+        if (sp->njoin) {
+            msgbuf_unref(sp->join[0]);
+            sp->join[0] = sp->join[1];
+            sp->njoin--;
+        } else {
+            sp->plen = 0;
+        }
+    }
+}
+
+// reaps spectators that hung up or were cut off, and feeds joining ones;
+// anything they send is discarded
+void *spec_thread(void *arg) {
+    (void)arg;
+    struct epoll_event evs[64];
+    char sink[256];
+    while (1) {
+        int n = epoll_wait(spec_ep, evs, 64, -1);
+        for (int i=0;i<n;i++) {
+            spectator_t *sp = evs[i].data.ptr;
+            if (evs[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&clients_mutex);
+                spec_flush(sp);
+                int joining = sp->joining;
+                pthread_mutex_unlock(&clients_mutex);
+                if (!joining) {
+                    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = sp };
+                    epoll_ctl(spec_ep, EPOLL_CTL_MOD, sp->fd, &ev);
+                }
+            }
+            ssize_t r = 1;
+            if (!(evs[i].events & (EPOLLHUP|EPOLLRDHUP|EPOLLERR))) {
+                if (!(evs[i].events & EPOLLIN)) continue;
+                while ((r = recv(sp->fd, sink, sizeof(sink), MSG_DONTWAIT)) > 0) {}
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            }
+            spec_free(sp);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * F_WATCH from the handshake loop: the socket stays non-blocking. It joins
+ * the room's list at once, with the name table and the room's history
+ * queued ahead of anything fanned out from then on; whatever of that the
+ * socket does not take right away spec_thread sends later. The send
+ * buffer keeps its default size until that has drained.
+ * Returns -1 if the caller should drop the connection.
+ */
+// the join data can take a history load from disk: built here, not in the
+// handshake loop, then the spectator goes live as spec_start did before
+void *spec_join_thread(void *arg) {
+    spectator_t *sp = arg;
+    msgbuf_t *names = names_table(), *hist = hist_get(sp->room);
+    if (names) sp->join[sp->njoin++] = names;
+    if (hist) sp->join[sp->njoin++] = hist;
+    pthread_mutex_lock(&clients_mutex);
+    spec_flush(sp);
+    spec_list_t *l = &spec_rooms[sp->room];
+    int ok = !sp->dead;
+    if (ok && l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        spectator_t **v = realloc(l->v, cap * sizeof(*v));
+        if (v) { l->v = v; l->cap = cap; }
+        else ok = 0;
+    }
+    if (ok) {
+        sp->slot = l->n;
+        l->v[l->n++] = sp;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (!ok) {
+        if (!sp->dead) send_to_sock(sp->fd, "*** server full, try again later\n");
+        close(sp->fd);
+        ip_release(sp->ip);
+        for (int i=0;i<sp->njoin;i++) msgbuf_unref(sp->join[i]);
+        free(sp->pend);
+        free(sp);
+        mem_release(MEM_CONN, SPEC_COST);
+        atomic_fetch_sub_explicit(&stat_spectators, 1, memory_order_relaxed);
+        return NULL;
+    }
+    // EPOLLOUT until the join data is out (spec_thread drops it then)
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLOUT, .data.ptr = sp };
+    if (epoll_ctl(spec_ep, EPOLL_CTL_ADD, sp->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        spec_free(sp);
+    }
+    return NULL;
+}
+
+// from the handshake loop: takes over fd and its IP count unless it returns -1
+int spec_start(int fd, uint32_t ip, int room) {
+    if (atomic_load(&stat_spectators) >= MAX_SPECTATORS) return -1;
+    spectator_t *sp = calloc(1, sizeof(*sp));
+    if (!sp) return -1;
+    int rcv = SPEC_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof(rcv));
+    sp->fd = fd;
+    sp->ip = ip;
+    sp->room = room;
+    sp->joining = 1;
+    mem_charge(MEM_CONN, SPEC_COST);
+    atomic_fetch_add_explicit(&stat_spectators, 1, memory_order_relaxed);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, &spec_join_thread, sp) != 0) {
+        mem_release(MEM_CONN, SPEC_COST);
+        atomic_fetch_sub_explicit(&stat_spectators, 1, memory_order_relaxed);
+        free(sp);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * Replication.
+ * A standby connects like a client but opens with F_REPL: how much of the
+ * log it has, and the port it will serve clients on. The log is append-only,
+ * so the standby's file is a prefix of ours and shipping is copying bytes:
+ * everything past its offset goes out with sendfile straight from the page
+ * cache, a catch-up of megabytes the same way as the last flush. The ship
+ * thread only reads back the offsets the standby has synced, for lag, and no
+ * send to it blocks longer than FAILOVER_MS: one that times out with nothing
+ * taken detaches the standby (it will have failed over by then anyway, or
+ * redials and catches up). While a standby is attached the log is
+ * flushed every REPL_MS instead of once per tick. Each batch is led by the
+ * log offset it ends at; with nothing new that is all that goes out, every
+ * REPL_MS, so the standby can tell an idle primary from a dead one.
+ */
+typedef struct {
+    int fd;
+    uint32_t ip;            // host order
+    uint16_t port;          // where it will take clients
+    off_t sent;
+    atomic_llong synced;    // last offset the standby reported on disk
+    uint8_t ack[8];
+    int ack_have;
+} replica_t;
+
+replica_t *replicas[MAX_REPLICAS];
+pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t repl_net;
+int repl_plen = -1;         // -A: who may replicate; nobody by default
+
+int repl_allowed(uint32_t ip) {
+    if (repl_plen < 0) return 0;
+    uint32_t mask = repl_plen ? ~0u << (32 - repl_plen) : 0;
+    return (ip & mask) == (repl_net & mask);
+}
+
+// D_STANDBY: where clients should go if we disappear
+size_t put_standby(char *p) {
+    replica_t *r = NULL;
+    pthread_mutex_lock(&repl_mutex);
+    for (int i=0;i<MAX_REPLICAS && !r;i++) r = replicas[i];
+    size_t n = 0;
+    if (r) {
+        n = put_down_hdr(p, D_STANDBY, 0, UID_SERVER, 6);
+        uint32_t ip = htonl(r->ip);
+        uint16_t port = htons(r->port);
+        memcpy(p + n, &ip, 4);
+        memcpy(p + n + 4, &port, 2);
+        n += 6;
+    }
+    pthread_mutex_unlock(&repl_mutex);
+    return n;
+}
+
+void announce_standby() {
+    char out[sizeof(down_hdr_t) + 6];
+    size_t n = put_standby(out);
+    if (!n) return;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i=0;i<MAX_CLIENTS;i++) {
+        if (clients[i] && clients[i]->uid != UID_NONE) send_bytes(clients[i]->sock, out, n);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// the standby reports synced offsets as a stream of u64s; take what has arrived
+int repl_read_acks(replica_t *r) {
+    while (1) {
+        ssize_t n = recv(r->fd, r->ack + r->ack_have, 8 - r->ack_have, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if ((r->ack_have += n) == 8) {
+            atomic_store(&r->synced, (long long)get_be64(r->ack));
+            r->ack_have = 0;
+        }
+    }
+}
+
+void *repl_thread(void *arg) {
+    replica_t *r = arg;
+    char start[8];
+    log_flush();
+    pthread_mutex_lock(&log_mutex);
+    // past our end, or not even the magic: not our prefix, start over
+    if (r->sent > log_off || r->sent < BLOG_MAGIC_LEN) r->sent = 0;
+    pthread_mutex_unlock(&log_mutex);
+    put_be64(start, r->sent);
+    // a stalled standby would block send/sendfile, and with them the heartbeat
+    struct timeval tv = { FAILOVER_MS / 1000, FAILOVER_MS % 1000 * 1000 };
+    setsockopt(r->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    fprintf(stderr, "repl: standby %u.%u.%u.%u:%u attached at offset %lld\n", r->ip >> 24, r->ip >> 16 & 255,
+            r->ip >> 8 & 255, r->ip & 255, r->port, (long long)r->sent);
+    if (send(r->fd, start, 8, MSG_NOSIGNAL) == 8) {
+        announce_standby();
+        while (1) {
+            pthread_mutex_lock(&log_mutex);
+            if (log_off == r->sent) {
+                struct timespec dl;
+                clock_gettime(CLOCK_REALTIME, &dl);
+                dl.tv_nsec += REPL_MS * 1000000L;
+                if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+                pthread_cond_timedwait(&repl_cond, &log_mutex, &dl);
+                if (log_len) log_flush_locked();
+            }
+            off_t end = log_off;
+            pthread_mutex_unlock(&log_mutex);
+            char hdr[8];
+            put_be64(hdr, end);
+            if (send(r->fd, hdr, 8, MSG_NOSIGNAL) != 8) break;
+            ssize_t w = 0;
+            // sendfile advances r->sent itself
+            while (r->sent < end && (w = sendfile(r->fd, log_fd, &r->sent, end - r->sent)) > 0) {
+                stat_add(&stat_bytes_out, w);
+            }
+            if (w < 0 || repl_read_acks(r) < 0) break;
+        }
+    }
+    fprintf(stderr, "repl: standby %u.%u.%u.%u:%u detached\n", r->ip >> 24, r->ip >> 16 & 255,
+            r->ip >> 8 & 255, r->ip & 255, r->port);
+    pthread_mutex_lock(&repl_mutex);
+    for (int i=0;i<MAX_REPLICAS;i++) if (replicas[i] == r) replicas[i] = NULL;
+    pthread_mutex_unlock(&repl_mutex);
+    close(r->fd);
+    ip_release(r->ip);
+    free(r);
+    return NULL;
+}
+
+// F_REPL from the handshake loop: payload is u64 offset, u16 client port
+int repl_start(int fd, uint32_t ip, const char *payload) {
+    replica_t *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
+    uint16_t port;
+    memcpy(&port, payload + 8, 2);
+    r->fd = fd;
+    r->ip = ip;
+    r->port = ntohs(port);
+    r->sent = get_be64(payload);
+    atomic_init(&r->synced, r->sent);
+    int slot = -1;
+    pthread_mutex_lock(&repl_mutex);
+    for (int i=0;i<MAX_REPLICAS && slot < 0;i++) if (!replicas[i]) { replicas[i] = r; slot = i; }
+    pthread_mutex_unlock(&repl_mutex);
+    if (slot < 0) { free(r); return -1; }
+    pthread_t tid;
+    pthread_create(&tid, NULL, &repl_thread, r);
+    pthread_detach(tid);
+    return 0;
+}
+
+void log_skip(const blog_rec_t *r, off_t at, void *ctx) { (void)r; (void)at; (void)ctx; }
+
+int tcp_dial(const char *host, int port) {
+    struct sockaddr_in a;
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &a.sin_addr) != 1) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    // a host that drops packets fails the connect in DIAL_MS, not minutes
+    struct timeval tv = { DIAL_MS / 1000, DIAL_MS % 1000 * 1000 }, none = { 0, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { close(fd); return -1; }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+    return fd;
+}
+
+/*
+ * Standby (-F host:port): append the primary's log to ours, syncing and
+ * reporting the offset every REPL_MS. Returns once the primary has been
+ * silent or unreachable for FAILOVER_MS after we followed it (it sends at
+ * least a batch header every REPL_MS); main then opens the log as usual
+ * (cutting any torn record) and starts serving.
+ */
+void repl_follow(const char *host, int primary_port, int my_port) {
+    crc32c_init();
+    int fd = open(LOGFILE, O_RDWR|O_CREAT, 0644);
+    if (fd < 0) { perror("open " LOGFILE); exit(1); }
+    char magic[BLOG_MAGIC_LEN];
+    off_t pos = lseek(fd, 0, SEEK_END);
+    if (pos > 0) {
+        if (pread(fd, magic, BLOG_MAGIC_LEN, 0) != BLOG_MAGIC_LEN || memcmp(magic, BLOG_MAGIC, BLOG_MAGIC_LEN) != 0) {
+            fprintf(stderr, "%s: not a chat binlog\n", LOGFILE);
+            exit(1);
+        }
+        pos = log_scan(fd, BLOG_MAGIC_LEN, log_skip, NULL);
+    }
+    char *buf = malloc(LOG_BUF);
+    if (!buf) { perror("malloc"); exit(1); }
+    uint64_t seen = 0;      // mono_ms() the primary was last heard from, 0 = never
+    while (!seen || mono_ms() - seen < FAILOVER_MS) {
+        int s = tcp_dial(host, primary_port);
+        char hello[10], start[8];
+        put_be64(hello, pos);
+        uint16_t p = htons(my_port);
+        memcpy(hello + 8, &p, 2);
+        struct timeval tv = { FAILOVER_MS / 1000, FAILOVER_MS % 1000 * 1000 };
+        if (s >= 0) setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (s < 0 || send_frame(s, F_REPL, 0, hello, sizeof(hello)) < 0 || recv_full(s, start, 8) < 0) {
+            if (s >= 0) close(s);
+            struct timespec ts = { 0, 200 * 1000000L };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        pos = get_be64(start);
+        if (ftruncate(fd, pos) < 0) { perror("ftruncate " LOGFILE); exit(1); }
+        fprintf(stderr, "standby: following %s:%d from offset %lld\n", host, primary_port, (long long)pos);
+        off_t synced = -1, end = pos;   // end: where the current batch stops
+        char hdr[8];
+        int hdr_have = 0;
+        seen = mono_ms();
+        while (mono_ms() - seen < FAILOVER_MS) {
+            struct pollfd pfd = { s, POLLIN, 0 };
+            if (poll(&pfd, 1, REPL_MS) > 0) {
+                ssize_t r;
+                if (pos == end) {
+                    // between batches: the next header
+                    if ((r = recv(s, hdr + hdr_have, 8 - hdr_have, 0)) <= 0) break;
+                    if ((hdr_have += r) == 8) {
+                        hdr_have = 0;
+                        end = get_be64(hdr);
+                        if (end < pos) break;
+                    }
+                } else {
+                    size_t want = end - pos < LOG_BUF ? end - pos : LOG_BUF;
+                    if ((r = recv(s, buf, want, 0)) <= 0) break;
+                    if (pwrite(fd, buf, r, pos) != r) { perror("write " LOGFILE); exit(1); }
+                    pos += r;
+                }
+                seen = mono_ms();
+            }
+            if (pos != synced) {
+                char v[8];
+                if (fdatasync(fd) < 0) perror("fdatasync " LOGFILE);
+                synced = pos;
+                put_be64(v, synced);
+                send(s, v, 8, MSG_NOSIGNAL);
+            }
+        }
+        close(s);
+        fprintf(stderr, "standby: lost the primary at offset %lld\n", (long long)pos);
+    }
+    free(buf);
+    close(fd);
+    fprintf(stderr, "standby: taking over\n");
+}
+
+/*
+ * Clustering.
+ * Every node gets the same -P list and builds the same ring: VNODES points
+ * per node, hashed from "host:port#i", so a node joining or leaving moves
+ * only the rooms on its arcs. A room's ring owner (first live node
+ * clockwise from the room's hash) decides where it lives, once, and
+ * remembers: itself, unless that would put it over the load bound (the
+ * average rooms per live node plus LOAD_SLACK percent), in which case the
+ * next node clockwise that is under it. Everyone else sends joins to the
+ * ring owner, so there is one decision per room without any agreement
+ * protocol. Nodes keep a link to each other (F_PEER) carrying their load
+ * every PEER_MS and "host this room" placements. When a link comes back
+ * up (the node may have restarted and forgotten) we repeat the placements
+ * we made on it, and say which rooms we host, so an owner that restarted
+ * learns them before placing them anew; a node whose link is down is
+ * skipped on the ring. The lobby is every node's own.
+ */
+enum { PEER_LOAD = 1, PEER_HOST = 2, PEER_HOSTED = 3 };
+
+typedef struct {
+    char host[48];
+    int port;
+    uint32_t ip;            // host order
+    int fd;                 // our link to it, -1 while down
+    pthread_mutex_t lock;   // one writer on fd at a time
+    atomic_int load;        // rooms it hosts, as last reported
+} peer_t;
+
+typedef struct {
+    uint32_t h;
+    int peer;
+} ring_point_t;
+
+peer_t peers[MAX_PEERS];
+int npeers, self_peer = -1;
+ring_point_t ring[MAX_PEERS * VNODES];
+int nring;
+int room_home[MAX_ROOMS];   // peer hosting the room, -1 = not placed yet
+pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong stat_redirects;
+
+uint32_t ring_hash(const char *s) {
+    uint32_t h = name_hash(s);
+    h ^= h >> 16; h *= 0x85ebca6bu; h ^= h >> 13; h *= 0xc2b2ae35u; h ^= h >> 16;
+    return h;
+}
+
+int ring_cmp(const void *a, const void *b) {
+    uint32_t x = ((const ring_point_t*)a)->h, y = ((const ring_point_t*)b)->h;
+    return x < y ? -1 : x > y;
+}
+
+int peer_up(int i) {
+    return i == self_peer || peers[i].fd >= 0;
+}
+
+// "ip:port,ip:port,..."; we are the entry with our listen port
+int cluster_init(const char *list, int port) {
+    char buf[1024], *save = NULL;
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *t = strtok_r(buf, ",", &save); t && npeers < MAX_PEERS; t = strtok_r(NULL, ",", &save)) {
+        peer_t *p = &peers[npeers];
+        struct in_addr a;
+        if (sscanf(t, "%47[^:]:%d", p->host, &p->port) != 2 || inet_pton(AF_INET, p->host, &a) != 1) return -1;
+        p->ip = ntohl(a.s_addr);
+        p->fd = -1;
+        pthread_mutex_init(&p->lock, NULL);
+        if (p->port == port && self_peer < 0) self_peer = npeers;
+        for (int v=0;v<VNODES;v++) {
+            char label[80];
+            snprintf(label, sizeof(label), "%s:%d#%d", p->host, p->port, v);
+            ring[nring].h = ring_hash(label);
+            ring[nring++].peer = npeers;
+        }
+        npeers++;
+    }
+    qsort(ring, nring, sizeof(ring[0]), ring_cmp);
+    for (int i=0;i<MAX_ROOMS;i++) room_home[i] = -1;
+    return self_peer < 0 ? -1 : 0;
+}
+
+// first ring point at or after h
+int ring_start(uint32_t h) {
+    int lo = 0, hi = nring;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].h < h) lo = mid + 1; else hi = mid;
+    }
+    return lo % nring;
+}
 
-void log_msg(const char *s) {
-    FILE *f = fopen(LOGFILE, "a");
-    if (!f) return;
-    time_t t = time(NULL);
-    char buf[64];
-    struct tm tm;
-    localtime_r(&t, &tm);
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
-    fprintf(f, "[%s] %s\n", buf, s);
-    fclose(f);
+int peer_load(int i) {
+    return atomic_load(&peers[i].load);
 }
 
-void send_to_sock(int sock, const char *msg) {
-    if (send(sock, msg, strlen(msg), 0) < 0) {
-        perror("send");
+// where a room lives; decides (and tells the chosen node) if we are its ring owner
+int room_place(int room) {
+    uint32_t h = ring_hash(room_names[room]);
+    int start = ring_start(h), owner = -1;
+    pthread_mutex_lock(&ring_mutex);
+    int home = room_home[room];
+    if (home >= 0 && peer_up(home)) { pthread_mutex_unlock(&ring_mutex); return home; }
+    for (int i=0;i<nring && owner < 0;i++) {
+        int p = ring[(start + i) % nring].peer;
+        if (peer_up(p)) owner = p;
+    }
+    if (owner != self_peer) { pthread_mutex_unlock(&ring_mutex); return owner; }
+    int live = 0, total = 1;    // counting the room being placed
+    for (int i=0;i<npeers;i++) if (peer_up(i)) { live++; total += peer_load(i); }
+    int cap = (total * (100 + LOAD_SLACK) + 100 * live - 1) / (100 * live);
+    home = owner;
+    for (int i=0;i<nring;i++) {
+        int p = ring[(start + i) % nring].peer;
+        if (peer_up(p) && peer_load(p) < cap) { home = p; break; }
     }
+    room_home[room] = home;
+    // counted now, so placements before the next report do not pile up
+    atomic_fetch_add(&peers[home].load, 1);
+    pthread_mutex_unlock(&ring_mutex);
+    if (home != self_peer) {
+        char msg[1 + ROOM_LEN];
+        size_t n = strlen(room_names[room]);
+        msg[0] = PEER_HOST;
+        memcpy(msg + 1, room_names[room], n);
+        pthread_mutex_lock(&peers[home].lock);
+        if (peers[home].fd >= 0) send_frame(peers[home].fd, F_PEER, 0, msg, 1 + n);
+        pthread_mutex_unlock(&peers[home].lock);
+    }
+    return home;
+}
+
+void send_redirect(int sock, int peer, int room) {
+    char out[sizeof(down_hdr_t) + 6 + ROOM_LEN];
+    size_t rl = strlen(room_names[room]);
+    size_t n = put_down_hdr(out, D_REDIRECT, 0, UID_SERVER, 6 + rl);
+    uint32_t ip = htonl(peers[peer].ip);
+    uint16_t port = htons(peers[peer].port);
+    memcpy(out + n, &ip, 4);
+    memcpy(out + n + 4, &port, 2);
+    memcpy(out + n + 6, room_names[room], rl);
+    send_bytes(sock, out, n + 6 + rl);
+    stat_add(&stat_redirects, 1);
 }
 
-void broadcast(const char *sender, const char *msg) {
-    char out[BUF_SIZE+128];
-    snprintf(out, sizeof(out), "%s: %s\n", sender, msg);
+// rooms with anyone in them here
+int local_load() {
+    uint8_t used[MAX_ROOMS] = { 0 };
+    int n = 0;
     pthread_mutex_lock(&clients_mutex);
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (clients[i]) {
-            send_to_sock(clients[i]->sock, out);
-        }
+    for (int i=0;i<MAX_CLIENTS;i++) {
+        if (clients[i] && clients[i]->room != 0 && !used[clients[i]->room]) { used[clients[i]->room] = 1; n++; }
     }
     pthread_mutex_unlock(&clients_mutex);
-    log_msg(out);
+    return n;
 }
 
-client_t *find_by_name(const char *name) {
-    client_t *found = NULL;
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (clients[i] && strcmp(clients[i]->name, name) == 0) {
-            found = clients[i];
-            break;
+// one per other node: keep a link up and report our load on it
+// a link to peer came up: the rooms we placed there, and the ones we host
+void peer_resend_hosts(int peer) {
+    peer_t *p = &peers[peer];
+    for (int r=1;r<MAX_ROOMS;r++) {
+        pthread_mutex_lock(&ring_mutex);
+        int home = room_home[r];
+        pthread_mutex_unlock(&ring_mutex);
+        if (home != peer && home != self_peer) continue;
+        char msg[1 + ROOM_LEN];
+        size_t n = strlen(room_names[r]);
+        msg[0] = home == peer ? PEER_HOST : PEER_HOSTED;
+        memcpy(msg + 1, room_names[r], n);
+        pthread_mutex_lock(&p->lock);
+        if (p->fd >= 0) send_frame(p->fd, F_PEER, 0, msg, 1 + n);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void *peer_out_thread(void *arg) {
+    peer_t *p = arg;
+    struct timespec ts = { PEER_MS / 1000, (PEER_MS % 1000) * 1000000L };
+    while (1) {
+        if (p->fd < 0) {
+            int fd = tcp_dial(p->host, p->port);
+            uint16_t me = htons(peers[self_peer].port);
+            if (fd >= 0 && send_frame(fd, F_PEER, 0, &me, 2) == 0) {
+                pthread_mutex_lock(&p->lock);
+                p->fd = fd;
+                pthread_mutex_unlock(&p->lock);
+                fprintf(stderr, "cluster: %s:%d up\n", p->host, p->port);
+                peer_resend_hosts(p - peers);
+            } else if (fd >= 0) {
+                close(fd);
+            }
         }
+        atomic_store(&peers[self_peer].load, local_load());
+        char msg[5];
+        uint32_t v = htonl(atomic_load(&peers[self_peer].load));
+        msg[0] = PEER_LOAD;
+        memcpy(msg + 1, &v, 4);
+        pthread_mutex_lock(&p->lock);
+        if (p->fd >= 0 && send_frame(p->fd, F_PEER, 0, msg, 5) < 0) {
+            close(p->fd);
+            p->fd = -1;
+            fprintf(stderr, "cluster: %s:%d down\n", p->host, p->port);
+        }
+        pthread_mutex_unlock(&p->lock);
+        nanosleep(&ts, NULL);
     }
-    return found;
+    return NULL;
 }
 
-void notify_userlist() {
-    // Build userlist string and broadcast as special message prefixed with "\x01USERS:"
-    char list[BUF_SIZE] = {0};
-    strcat(list, "\x01USERS:");
-    pthread_mutex_lock(&clients_mutex);
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (clients[i]) {
-            strcat(list, clients[i]->name);
-            strcat(list, ",");
+typedef struct {
+    int fd;
+    int peer;
+} peer_in_t;
+
+// a node's link to us: its load reports and the rooms it placed here
+void *peer_in_thread(void *arg) {
+    peer_in_t *in = arg;
+    frame_hdr_t h;
+    char buf[BUF_SIZE];
+    ssize_t len;
+    while ((len = recv_frame(in->fd, &h, buf, sizeof(buf))) >= 0) {
+        if (h.type != F_PEER || len < 1) continue;
+        if (buf[0] == PEER_LOAD && len == 5) {
+            uint32_t v;
+            memcpy(&v, buf + 1, 4);
+            atomic_store(&peers[in->peer].load, ntohl(v));
+        } else if (buf[0] == PEER_HOST) {
+            int room = room_find(buf + 1, 1);
+            if (room > 0) {
+                pthread_mutex_lock(&ring_mutex);
+                room_home[room] = self_peer;
+                pthread_mutex_unlock(&ring_mutex);
+            }
+        } else if (buf[0] == PEER_HOSTED) {
+            // only fills a gap: a placement we made since wins
+            int room = room_find(buf + 1, 1);
+            if (room > 0) {
+                pthread_mutex_lock(&ring_mutex);
+                if (room_home[room] < 0) room_home[room] = in->peer;
+                pthread_mutex_unlock(&ring_mutex);
+            }
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
-    // send to all clients
+    close(in->fd);
+    ip_release(peers[in->peer].ip);
+    free(in);
+    return NULL;
+}
+
+// F_PEER hello from the handshake loop: payload is the node's u16 port
+int peer_in_start(int fd, uint32_t ip, const char *payload) {
+    uint16_t port;
+    memcpy(&port, payload, 2);
+    int peer = -1;
+    for (int i=0;i<npeers;i++) if (peers[i].ip == ip && peers[i].port == ntohs(port) && i != self_peer) peer = i;
+    if (peer < 0) return -1;
+    peer_in_t *in = malloc(sizeof(*in));
+    if (!in) return -1;
+    in->fd = fd;
+    in->peer = peer;
+    pthread_t tid;
+    pthread_create(&tid, NULL, &peer_in_thread, in);
+    pthread_detach(tid);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint32_t ip;
+} relay_in_t;
+
+// something said below us: pass it on up, or publish it if we are the origin
+void relay_publish(const char *p, size_t len) {
+    char rname[ROOM_LEN], name[NAME_LEN];
+    uint64_t ts;
+    const char *text;
+    if (up_port) {
+        pthread_mutex_lock(&upstream_mutex);
+        if (upstream_fd >= 0) send_frame(upstream_fd, F_RELAYED, 0, p, len);
+        pthread_mutex_unlock(&upstream_mutex);
+        return;
+    }
+    if (get_relay(p, len, rname, name, &ts, &text) < 0) return;
+    int room = room_find(rname, 1);
+    uint32_t uid = room < 0 ? UID_NONE : intern_user(name);
+    if (uid == UID_NONE || atomic_load(&intern_tab[uid].banned)) return;
+    if (hh_ingest(uid, room)) { stat_add(&stat_limited, 1); return; }
+    uint64_t t0 = mono_us();
+    broadcast(room, uid, text, PRIO_NORMAL, now_ms());
+    stat_add(&stat_msgs, 1);
+    stat_latency(mono_us() - t0);
+}
+
+// a relay below us: gets D_RELAY from broadcast(), sends its clients' lines up
+void *relay_in_thread(void *arg) {
+    relay_in_t *r = arg;
+    frame_hdr_t h;
+    char buf[BUF_SIZE + 2 + ROOM_LEN + NAME_LEN + 8];
+    ssize_t len;
+    while ((len = recv_frame(r->fd, &h, buf, sizeof(buf))) >= 0) {
+        stat_add(&stat_bytes_in, sizeof(h) + len);
+        if (h.type == F_RELAYED) relay_publish(buf, len);
+    }
     pthread_mutex_lock(&clients_mutex);
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (clients[i]) send_to_sock(clients[i]->sock, list);
+    for (int i=0;i<nrelay_fds;i++) {
+        if (relay_fds[i] == r->fd) { relay_fds[i] = relay_fds[--nrelay_fds]; break; }
     }
     pthread_mutex_unlock(&clients_mutex);
+    fprintf(stderr, "relay: downstream relay gone\n");
+    close(r->fd);
+    ip_release(r->ip);
+    free(r);
+    return NULL;
 }
 
-void add_client(client_t *cl) {
+// F_RELAY hello from the handshake loop
+int relay_in_start(int fd, uint32_t ip) {
+    relay_in_t *r = malloc(sizeof(*r));
+    if (!r) return -1;
+    r->fd = fd;
+    r->ip = ip;
     pthread_mutex_lock(&clients_mutex);
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (!clients[i]) {
-            clients[i] = cl;
-            break;
+    int ok = nrelay_fds < MAX_RELAYS;
+    if (ok) relay_fds[nrelay_fds++] = fd;
+    pthread_mutex_unlock(&clients_mutex);
+    if (!ok) { free(r); return -1; }
+    fprintf(stderr, "relay: downstream relay attached\n");
+    pthread_t tid;
+    pthread_create(&tid, NULL, &relay_in_thread, r);
+    pthread_detach(tid);
+    return 0;
+}
+
+// a local client's line on a relay: up to the origin, back down to everyone
+int relay_up(int room, uint32_t uid, const char *text) {
+    char p[2 + ROOM_LEN + NAME_LEN + 8 + BUF_SIZE];
+    size_t n = strlen(text);
+    if (n > BUF_SIZE) n = BUF_SIZE;
+    size_t len = put_relay(p, room_names[room], uid_name(uid), 0, text, n);
+    int r = -1;
+    pthread_mutex_lock(&upstream_mutex);
+    if (upstream_fd >= 0) r = send_frame(upstream_fd, F_RELAYED, 0, p, len);
+    pthread_mutex_unlock(&upstream_mutex);
+    return r;
+}
+
+// -U: keep one subscription to the tier above and re-broadcast what it sends
+void *upstream_thread(void *arg) {
+    int my_port = (int)(intptr_t)arg;
+    char buf[BUF_SIZE + 2 + ROOM_LEN + NAME_LEN + 8];
+    struct timespec ts = { PEER_MS / 1000, (PEER_MS % 1000) * 1000000L };
+    while (1) {
+        int fd = tcp_dial(up_host, up_port);
+        uint16_t me = htons(my_port);
+        if (fd < 0 || send_frame(fd, F_RELAY, 0, &me, 2) < 0) {
+            if (fd >= 0) close(fd);
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        pthread_mutex_lock(&upstream_mutex);
+        upstream_fd = fd;
+        pthread_mutex_unlock(&upstream_mutex);
+        fprintf(stderr, "relay: subscribed to %s:%d\n", up_host, up_port);
+        down_hdr_t h;
+        while (recv_full(fd, &h, sizeof(h)) == 0) {
+            uint32_t len = ntohl(h.len);
+            if (len >= sizeof(buf) || recv_full(fd, buf, len) < 0) break;
+            buf[len] = '\0';
+            stat_add(&stat_bytes_in, sizeof(h) + len);
+            char rname[ROOM_LEN], name[NAME_LEN];
+            uint64_t mts;
+            const char *text;
+            if (h.type != D_RELAY || get_relay(buf, len, rname, name, &mts, &text) < 0) continue;
+            relay_depth = h.flags + 1;
+            int room = room_find(rname, 1);
+            uint32_t uid = room < 0 ? UID_NONE : intern_user(name);
+            if (uid == UID_NONE) continue;
+            uint64_t t0 = mono_us();
+            broadcast(room, uid, text, PRIO_NORMAL, mts);
+            stat_add(&stat_msgs, 1);
+            stat_latency(mono_us() - t0);
         }
+        pthread_mutex_lock(&upstream_mutex);
+        upstream_fd = -1;
+        pthread_mutex_unlock(&upstream_mutex);
+        close(fd);
+        fprintf(stderr, "relay: lost %s:%d\n", up_host, up_port);
+        nanosleep(&ts, NULL);
     }
-    pthread_mutex_unlock(&clients_mutex);
-    notify_userlist();
+    return NULL;
 }
 
-void remove_client(client_t *cl) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i=0;i<MAX_CLIENTS;i++){
-        if (clients[i] == cl) {
-            clients[i] = NULL;
-            break;
+/*
+ * Shards (-R). Cluster nodes on one host can also share one public port
+ * through SO_REUSEPORT, and then the kernel picks which node accepts a
+ * connection. A node hands a client whose /join names a room living on a
+ * co-located peer over to that peer's process, socket and all (SCM_RIGHTS
+ * over an abstract unix socket), rather than redirecting it: the client
+ * keeps its connection and gets a fresh session there. Where eBPF is
+ * available, an SK_REUSEPORT program on the group also steers each new
+ * connection by source address to the node that last took that address
+ * into a room, so most users land where their room lives and its fan-out
+ * stays inside one process. Its two maps are shared between the nodes by
+ * passing their fds the same way. Abstract sockets have no file modes, so
+ * both ends check the other is running as our own user (SO_PEERCRED).
+ */
+enum { MIG_CONN = 1, MIG_MAPS = 2 };
+
+typedef struct {
+    uint8_t kind;
+    char name[NAME_LEN];
+    char room[ROOM_LEN];
+} mig_msg_t;
+
+int shard_port;             // -R
+int shard_fd = -1;          // our listener in the shared port's reuseport group
+int steer_ips = -1;         // bpf hash: source IPv4 (network order) -> node
+int steer_socks = -1;       // bpf reuseport sockarray: node -> its listener
+atomic_ulong stat_migrated_out, stat_migrated_in, stat_steer_learned;
+
+socklen_t mig_addr(struct sockaddr_un *a, int port) {
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    // abstract namespace: nothing left behind on the filesystem
+    int n = snprintf(a->sun_path + 1, sizeof(a->sun_path) - 1, "chat-shard-%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+int fd_send(int s, const void *p, size_t n, const int *fds, int nfds) {
+    char ctl[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { (void*)p, n };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds) {
+        m.msg_control = ctl;
+        m.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+    return sendmsg(s, &m, MSG_NOSIGNAL) == (ssize_t)n ? 0 : -1;
+}
+
+// returns how many fds came with the message (at most 2), -1 on error
+int fd_recv(int s, void *p, size_t n, int *fds) {
+    char ctl[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { p, n };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    if (recvmsg(s, &m, MSG_CMSG_CLOEXEC) <= 0) return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) return 0;
+    int nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nfds > 2) nfds = 2;
+    memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+    return nfds;
+}
+
+// the other end of a unix socket runs as our user
+int mig_trusted(int s) {
+    struct ucred cr;
+    socklen_t len = sizeof(cr);
+    return getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cr, &len) == 0 && cr.uid == geteuid();
+}
+
+// a connected link to peer's migration socket, -1 if it is not running (or not ours)
+int mig_dial(int peer) {
+    struct sockaddr_un a;
+    socklen_t len = mig_addr(&a, peers[peer].port);
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s >= 0 && connect(s, (struct sockaddr*)&a, len) < 0) { close(s); s = -1; }
+    if (s >= 0 && !mig_trusted(s)) {
+        fprintf(stderr, "shards: %s is held by another user, not migrating\n", a.sun_path + 1);
+        close(s);
+        s = -1;
+    }
+    return s;
+}
+
+long bpf_call(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int bpf_map(int type, int max) {
+    union bpf_attr a;
+    memset(&a, 0, sizeof(a));
+    a.map_type = type;
+    a.key_size = a.value_size = 4;
+    a.max_entries = max;
+    return bpf_call(BPF_MAP_CREATE, &a);
+}
+
+int bpf_put(int map, uint32_t key, uint32_t val) {
+    union bpf_attr a;
+    memset(&a, 0, sizeof(a));
+    a.map_fd = map;
+    a.key = (uintptr_t)&key;
+    a.value = (uintptr_t)&val;
+    return bpf_call(BPF_MAP_UPDATE_ELEM, &a);
+}
+
+#define INSN(code, dst, src, off, imm) ((struct bpf_insn){ code, dst, src, off, imm })
+
+/*
+ * The steering program, per incoming SYN:
+ *   load the source address from the IP header onto the stack
+ *   node = steer_ips[addr], or leave it to the kernel's hash
+ *   select steer_socks[node] (an empty slot also falls back to the hash)
+ */
+int steer_prog() {
+    struct bpf_insn p[] = {
+        INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_2, 0, 0, 12),
+        INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_3, 0, 0, -4),
+        INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_4, 0, 0, 4),
+        INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET),
+        INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative),
+        INSN(BPF_JMP|BPF_JNE|BPF_K, BPF_REG_0, 0, 12, 0),
+        INSN(BPF_LD|BPF_DW|BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, steer_ips),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_2, 0, 0, -4),
+        INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP|BPF_JEQ|BPF_K, BPF_REG_0, 0, 6, 0),
+        INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_3, BPF_REG_0, 0, 0),
+        INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD|BPF_DW|BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, steer_socks),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+        INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+    };
+    char log[4096] = "";
+    union bpf_attr a;
+    memset(&a, 0, sizeof(a));
+    a.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+    a.insns = (uintptr_t)p;
+    a.insn_cnt = sizeof(p) / sizeof(p[0]);
+    a.license = (uintptr_t)"GPL";
+    a.log_buf = (uintptr_t)log;
+    a.log_size = sizeof(log);
+    a.log_level = 1;
+    int fd = bpf_call(BPF_PROG_LOAD, &a);
+    if (fd < 0 && log[0]) fprintf(stderr, "shards: verifier says:\n%s", log);
+    return fd;
+}
+
+// share a running peer's maps (or make them), enter our listener, attach the program
+void steer_init() {
+    mig_msg_t m = { MIG_MAPS, "", "" };
+    for (int i=0;i<npeers && steer_ips < 0;i++) {
+        int s = i == self_peer ? -1 : mig_dial(i), fds[2];
+        if (s < 0) continue;
+        if (fd_send(s, &m, sizeof(m), NULL, 0) == 0 && fd_recv(s, &m, sizeof(m), fds) == 2) {
+            steer_ips = fds[0];
+            steer_socks = fds[1];
+        }
+        close(s);
+    }
+    if (steer_ips < 0) {
+        steer_ips = bpf_map(BPF_MAP_TYPE_HASH, STEER_IPS);
+        steer_socks = bpf_map(BPF_MAP_TYPE_REUSEPORT_SOCKARRAY, MAX_PEERS);
+    }
+    int prog = -1;
+    if (steer_ips < 0 || steer_socks < 0 || bpf_put(steer_socks, self_peer, shard_fd) < 0 || (prog = steer_prog()) < 0 ||
+        setsockopt(shard_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog, sizeof(prog)) < 0) {
+        perror("shards: no eBPF steering, clients are moved after login only");
+        if (steer_ips >= 0) close(steer_ips);
+        if (steer_socks >= 0) close(steer_socks);
+        steer_ips = steer_socks = -1;
+    }
+    if (prog >= 0) close(prog);     // the reuseport group holds it now
+}
+
+// new connections from ip go to node from now on
+void steer_learn(uint32_t ip, int node) {
+    if (steer_ips >= 0 && bpf_put(steer_ips, htonl(ip), node) == 0) stat_add(&stat_steer_learned, 1);
+}
+
+// hand cli over to peer's process, which will put it in room; 0 once it is theirs
+int shard_migrate(client_t *cli, int peer, int room) {
+    int s = mig_dial(peer);
+    if (s < 0) return -1;
+    mig_msg_t m = { MIG_CONN, "", "" };
+    snprintf(m.name, sizeof(m.name), "%s", uid_name(cli->uid));
+    snprintf(m.room, sizeof(m.room), "%s", room_names[room]);
+    // out of fan-out first: from the handover on, only the peer writes to it
+    remove_client(cli);
+    int r = fd_send(s, &m, sizeof(m), &cli->sock, 1);
+    close(s);
+    if (r < 0) {
+        perror("shards: migrate");
+        if (relink_client(cli) < 0) return 0;     // nowhere to go: dropped like a full server would
+        return -1;
+    }
+    stat_add(&stat_migrated_out, 1);
+    return 0;
+}
+
+// returns 1 if cli now belongs to another process
+int join_room(client_t *cli, const char *name) {
+    int room = room_find(name, 1);
+    if (room < 0) {
+        send_to_sock(cli->sock, "*** invalid room name (or too many rooms)\n");
+        return 0;
+    }
+    if (room == cli->room) return 0;
+    if (npeers && room != 0) {
+        int home = room_place(room);
+        if (home >= 0 && home != self_peer) {
+            if (shard_port && shard_migrate(cli, home, room) == 0) return 1;
+            send_redirect(cli->sock, home, room);
+            return 0;
         }
+        steer_learn(cli->ip, self_peer);
     }
+    presence_event(cli->room, cli->uid, 0);
+    pthread_mutex_lock(&clients_mutex);
+    cli->room = room;
+    cli->need_list = 1;
+    uint32_t seq = room_seq[room];
     pthread_mutex_unlock(&clients_mutex);
-    notify_userlist();
+    if (cli->mcast) mc_send_base(cli, room, seq);
+    presence_event(room, cli->uid, 1);
+    send_history(cli);
+    return 0;
+}
+
+// -D: tell the sender its message id is on disk
+void send_ack(client_t *cli, uint64_t id, int room, uint32_t seq) {
+    char out[sizeof(down_hdr_t) + 12];
+    size_t n = put_down_hdr(out, D_ACK, room, UID_SERVER, 12);
+    memcpy(out + n, &id, 8);        // echoed as the client sent it
+    uint32_t v = htonl(seq);
+    memcpy(out + n + 8, &v, 4);
+    send_bytes(cli->sock, out, n + 12);
+}
+
+/*
+ * Low-latency profile (-L). A blocked recv costs a sleep and a wakeup per
+ * message, and that wakeup is most of a quiet server's tail. Each listed
+ * core is a spin slot: a client thread that gets a chat line claims a free
+ * one, pins itself there and from then on polls its socket with non-blocking
+ * recv instead of sleeping, until no line has come for LL_HOLD_MS (probes and
+ * acks do not count). So the few senders that are actually talking never
+ * sleep, and everyone else blocks as usual (there are far more threads than
+ * cores). All other threads are confined to the remaining cores at startup,
+ * so a spinner shares its core with nothing; isolate them (isolcpus,
+ * nohz_full) for the rest. Sockets also get SO_BUSY_POLL, which makes the
+ * kernel poll the device queue on recv rather than wait for its interrupt.
+ */
+int ll_cpus[LL_MAX_CPUS], ll_ncpus;
+atomic_int ll_busy[LL_MAX_CPUS];
+cpu_set_t ll_rest;          // everything but the spin cores
+int ll_shared;              // ... unless that left none: then spinners yield
+atomic_ulong stat_ll_claims;
+
+// "2,3" or "4-7": the spin cores
+void ll_parse(char *arg) {
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        int lo, hi, n = sscanf(tok, "%d-%d", &lo, &hi);
+        if (n == 1) hi = lo;
+        if (n < 1 || lo < 0 || hi < lo || hi >= CPU_SETSIZE) { fprintf(stderr, "-L: bad cpu list\n"); exit(1); }
+        for (int c=lo;c<=hi && ll_ncpus<LL_MAX_CPUS;c++) ll_cpus[ll_ncpus++] = c;
+    }
+    if (!ll_ncpus) { fprintf(stderr, "-L: bad cpu list\n"); exit(1); }
+}
+
+// main, before any thread exists: everything started from here inherits ll_rest
+void ll_init() {
+    if (sched_getaffinity(0, sizeof(ll_rest), &ll_rest) < 0) { perror("sched_getaffinity"); exit(1); }
+    for (int i=0;i<ll_ncpus;i++) CPU_CLR(ll_cpus[i], &ll_rest);
+    if (!CPU_COUNT(&ll_rest)) {
+        fprintf(stderr, "-L: no cores left for the other threads, they share the spin cores\n");
+        sched_getaffinity(0, sizeof(ll_rest), &ll_rest);
+        ll_shared = 1;
+    }
+    if (sched_setaffinity(0, sizeof(ll_rest), &ll_rest) < 0) perror("sched_setaffinity");
+}
+
+void ll_socket(int fd) {
+    if (!ll_ncpus) return;
+    int us = LL_BUSY_US, one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#else
+    (void)one;
+#endif
+}
+
+void ll_release(client_t *cli) {
+    if (cli->ll_slot < 0) return;
+    pthread_setaffinity_np(pthread_self(), sizeof(ll_rest), &ll_rest);
+    atomic_store(&ll_busy[cli->ll_slot], 0);
+    cli->ll_slot = -1;
+}
+
+// before each blocking read: spin here while this thread holds (or can get) a core
+void ll_wait(client_t *cli) {
+    if (!ll_ncpus) return;
+    if (cli->ll_slot < 0) {
+        if (mono_ms() - cli->ll_last > LL_HOLD_MS) return;     // quiet: just sleep in recv
+        for (int i=0;i<ll_ncpus && cli->ll_slot < 0;i++) {
+            int idle = 0;
+            if (!atomic_compare_exchange_strong(&ll_busy[i], &idle, 1)) continue;
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(ll_cpus[i], &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            cli->ll_slot = i;
+            stat_add(&stat_ll_claims, 1);
+        }
+        if (cli->ll_slot < 0) return;
+    }
+    char c;
+    while (recv(cli->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EINTR)) {
+        if (mono_ms() - cli->ll_last > LL_HOLD_MS) { ll_release(cli); return; }
+        if (ll_shared) sched_yield();
+    }
+}
+
+int ll_spinning() {
+    int n = 0;
+    for (int i=0;i<ll_ncpus;i++) n += atomic_load(&ll_busy[i]);
+    return n;
 }
 
 void *handle_client(void *arg) {
     client_t *cli = (client_t*)arg;
     char buf[BUF_SIZE];
-    // first message should be the username (null-terminated)
-    ssize_t r = recv(cli->sock, buf, NAME_LEN-1, 0);
-    if (r <= 0) { close(cli->sock); remove_client(cli); free(cli); return NULL; }
-    buf[r] = '\0';
-    strncpy(cli->name, buf, NAME_LEN-1);
-    // announce
-    char joinmsg[128]; snprintf(joinmsg, sizeof(joinmsg), "*** %s joined", cli->name);
-    broadcast("server", joinmsg);
+    frame_hdr_t h;
+    // the accept loop already read the hello frame and interned the name
+    uint32_t uid = cli->login_uid;
+    if (cli->login_new) announce_name(uid);
+    if (!(cli->sess = session_attach(uid))) {
+        remove_client(cli); client_free(cli); return NULL;
+    }
+    // names go out before anything that refers to them by id
+    msgbuf_t *names = names_table();
+    if (names) { send_buf(cli->sock, names); msgbuf_unref(names); }
+    session_resume(cli);
+    pthread_mutex_lock(&clients_mutex);
+    cli->uid = uid;
+    cli->need_list = 1;
+    intern_tab[uid].conn = cli;
+    pthread_mutex_unlock(&clients_mutex);
+    // announced with the next presence tick
+    presence_event(cli->room, cli->uid, 1);
+    send_history(cli);
+    int moved = 0;
+    char standby[sizeof(down_hdr_t) + 6];
+    size_t sn = put_standby(standby);
+    if (sn) send_bytes(cli->sock, standby, sn);
+    if (mc_fd >= 0) {
+        char out[sizeof(down_hdr_t) + 14];
+        size_t n = put_down_hdr(out, D_MCAST, 0, UID_SERVER, 14);
+        uint32_t iface = htonl(mc_iface), stream = htonl(mc_stream);
+        memcpy(out + n, &mc_addr.sin_addr, 4);
+        memcpy(out + n + 4, &mc_addr.sin_port, 2);
+        memcpy(out + n + 6, &iface, 4);
+        memcpy(out + n + 10, &stream, 4);
+        send_bytes(cli->sock, out, n + 14);
+    }
 
     while (1) {
-        ssize_t len = recv(cli->sock, buf, BUF_SIZE-1, 0);
-        if (len <= 0) break;
-        buf[len] = '\0';
+        ll_wait(cli);
+        ssize_t len = recv_frame(cli->sock, &h, buf, BUF_SIZE);
+        if (len < 0) break;
+        stat_add(&stat_bytes_in, sizeof(h) + len);
+        if (h.type == F_PROBE && len == 8) {
+            // echo at once, ahead of everything else this thread would do
+            char out[sizeof(down_hdr_t) + 16];
+            size_t n = put_down_hdr(out, D_PROBE, 0, UID_SERVER, 16);
+            memcpy(out + n, buf, 8);
+            put_be64(out + n + 8, real_us());
+            send_bytes(cli->sock, out, n + 16);
+            continue;
+        }
+        if (h.type == F_ACK && len == 8) {
+            session_ack(cli, get_be64(buf));
+            continue;
+        }
+        if (h.type == F_MCAST && len == 0) { mc_enable(cli); continue; }
+        if (h.type == F_MCAST && len == 6) { mc_disable(cli, buf); continue; }
+        if (h.type == F_NACK && len == 10) { mc_repair(cli, buf); continue; }
+        if (h.type != F_MSG) continue;
+        // only chat keeps a spin core: probes and acks arrive from idle clients too
+        if (ll_ncpus) cli->ll_last = mono_ms();
+        uint64_t ts = now_ms();     // the message's one and only stamp
+        uint64_t t0 = mono_us();
+        // a resend of something already handled: drop before any fan-out or
+        // logging, but in -D mode ack it again once the original is on disk
+        if (session_seen(cli->sess, h.id)) {
+            if (durable && log_wait_durable(log_end()) == 0) send_ack(cli, h.id, cli->room, 0);
+            else if (durable) send_to_sock(cli->sock, "*** server log failed: message not saved to disk\n");
+            continue;
+        }
+
+        if (strncmp(buf, "/join ", 6) == 0) {
+            if (join_room(cli, buf + 6)) { moved = 1; break; }
+            continue;
+        }
+        // from here the id may be stored (limiter, history, log): keep the name
+        intern_keep(cli->uid);
+        // counted before the verdict, so a sender that keeps flooding stays limited
+        if (hh_ingest(cli->uid, buf[0] == '@' ? -1 : cli->room)) {
+            session_forget(cli->sess, h.id);
+            stat_add(&stat_limited, 1);
+            unsigned e = atomic_load(&hh_epoch) + 1;
+            if (cli->warned != e) {
+                send_to_sock(cli->sock, "*** slow down: messages are being dropped\n");
+                cli->warned = e;
+            }
+            continue;
+        }
 
-        // check private message: starts with @username<space>
+        // private message: "@name text" or "@a,b,c text"
+        uint32_t seq;
+        int room = cli->room, sent;
         if (buf[0] == '@') {
-            // parse name
-            char target[NAME_LEN] = {0};
-            int i=1, j=0;
-            while (i < len && buf[i] != ' ' && j < NAME_LEN-1) {
-                target[j++] = buf[i++]; 
-            }
-            target[j] = '\0';
-            char *message = buf + i;
-            client_t *rcv = find_by_name(target);
-            char out[BUF_SIZE+64];
-            snprintf(out, sizeof(out), "(private) %s -> %s: %s\n", cli->name, target, message);
-            log_msg(out);
-            // send to target and sender and server
-            if (rcv) send_to_sock(rcv->sock, out);
-            send_to_sock(cli->sock, out);
+            seq = send_private(cli, buf + 1, ts);
+            sent = seq != 0;
+            room = 0;
+        } else if (up_port) {
+            // on a relay the origin stamps and orders it; it comes back down
+            sent = relay_up(room, cli->uid, buf) == 0;
+            if (!sent) send_to_sock(cli->sock, "*** upstream unavailable, message not sent\n");
+            seq = 0;
         } else {
             // public broadcast
-            broadcast(cli->name, buf);
+            seq = broadcast(room, cli->uid, buf, PRIO_NORMAL, ts);
+            sent = seq != 0;
+        }
+        // not stored or delivered anywhere: a resend is not a duplicate
+        if (!sent) session_forget(cli->sess, h.id);
+        if (durable && seq && h.id) {
+            if (log_wait_durable(log_end()) == 0) send_ack(cli, h.id, room, seq);
+            else send_to_sock(cli->sock, "*** server log failed: message not saved to disk\n");
         }
+        stat_add(&stat_msgs, 1);
+        stat_latency(mono_us() - t0);
     }
 
-    // disconnect
-    close(cli->sock);
-    char leavemsg[128]; snprintf(leavemsg, sizeof(leavemsg), "*** %s left", cli->name);
-    broadcast("server", leavemsg);
-    remove_client(cli);
-    free(cli);
+    // disconnect: unlink before closing so no fan-out writes to a reused fd
+    // (a migrated client was unlinked before the handover)
+    if (!moved) remove_client(cli);
+    ll_release(cli);
+    session_detach(cli->sess, cli);
+    client_free(cli);
+    return NULL;
+}
+
+/*
+ * Handshake loop (main thread).
+ * A new connection costs one pending_t slot from a fixed array and one
+ * epoll registration, nothing else, until its F_HELLO frame is complete;
+ * only then do we allocate a client_t and start its thread. Reads take no
+ * more than the hello frame, so anything pipelined behind it stays in the
+ * socket for the client thread. Connections that miss HANDSHAKE_MS, send
+ * junk, exceed the per-IP cap or hit a banned range are reset; when every
+ * slot is busy the oldest pending connection makes room. TCP_DEFER_ACCEPT
+ * keeps connections that never send a byte out of accept() entirely.
+ */
+typedef struct {
+    int fd;             // -1 = free slot
+    uint32_t ip;
+    uint64_t deadline;  // mono_ms()
+    uint32_t got;
+    char buf[sizeof(frame_hdr_t) + NAME_LEN];
+} pending_t;
+
+pending_t pend[MAX_PENDING];
+atomic_ulong hs_dropped;
+
+// reset rather than FIN: no reply, nothing lingers in TIME_WAIT
+void close_rst(int fd) {
+    struct linger rst = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &rst, sizeof(rst));
+    close(fd);
+}
+
+void pend_drop(pending_t *p) {
+    close_rst(p->fd);
+    ip_release(p->ip);
+    p->fd = -1;
+    atomic_fetch_add(&hs_dropped, 1);
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+}
+
+// a logged-in connection (blocking, counted against its IP) gets its thread
+int client_start(int fd, uint32_t ip, uint32_t uid, int is_new, int room) {
+    mem_charge(MEM_CONN, CONN_COST);
+    client_t *cli = (client_t*)malloc(sizeof(client_t));
+    cli->sock = fd;
+    cli->room = room;
+    cli->need_list = 0;
+    cli->uid = UID_NONE;
+    cli->ip = ip;
+    cli->login_uid = uid;
+    cli->login_new = is_new;
+    cli->warned = 0;
+    cli->mcast = 0;
+    cli->ll_slot = -1;
+    cli->ll_last = 0;
+    cli->sess = NULL;
+    ll_socket(fd);
+    if (add_client(cli) < 0) {
+        send_to_sock(cli->sock, "*** server full, try again later\n");
+        client_free(cli);
+        return -1;
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, &handle_client, (void*)cli);
+    pthread_detach(tid);
+    return 0;
+}
+
+// hello complete: from here on the connection is a normal client
+void pend_promote(int ep, pending_t *p) {
+    frame_hdr_t *h = (frame_hdr_t*)p->buf;
+    char *name = p->buf + sizeof(frame_hdr_t);
+    name[ntohl(h->len)] = '\0';
+    int is_new = 0;
+    uint32_t uid = intern(name, INTERN_FIND, NULL);
+    if (uid != UID_NONE && atomic_load(&intern_tab[uid].banned)) {
+        send_to_sock(p->fd, "*** you are banned\n");
+        pend_drop(p);
+        return;
+    }
+    // admission control: last pressure tier refuses new connections outright
+    if (mem_tier() >= TIER_REFUSE) {
+        send_to_sock(p->fd, "*** server busy, try again later\n");
+        pend_drop(p);
+        return;
+    }
+    // held by the connection from here on, dropped in client_free
+    uid = intern(name, INTERN_REF, &is_new);
+    if (uid == UID_NONE) { pend_drop(p); return; }
+    epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    int fd = p->fd;
+    p->fd = -1;
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+    client_start(fd, p->ip, uid, is_new, 0);
+}
+
+/*
+ * A client handed over by a co-located shard (MIG_CONN): logged in there
+ * already, so only the name checks of pend_promote are repeated here; it
+ * starts out in the room it asked for, or is passed on once more if that
+ * room was placed on yet another node.
+ */
+void shard_adopt(int fd, mig_msg_t *m) {
+    struct sockaddr_in a;
+    socklen_t alen = sizeof(a);
+    m->name[NAME_LEN-1] = m->room[ROOM_LEN-1] = '\0';
+    int room = room_find(m->room, 1), is_new = 0;
+    uint32_t uid = intern(m->name, INTERN_REF, &is_new);
+    if (getpeername(fd, (struct sockaddr*)&a, &alen) < 0 || room < 0 || uid == UID_NONE ||
+        atomic_load(&intern_tab[uid].banned) || mem_tier() >= TIER_REFUSE) {
+        intern_unref(uid);
+        close(fd);
+        return;
+    }
+    // the room's ring owner may have placed it elsewhere: pass the client on
+    int home = room_place(room);
+    if (home >= 0 && home != self_peer) {
+        int s = mig_dial(home);
+        int ok = s >= 0 && fd_send(s, m, sizeof(*m), &fd, 1) == 0;
+        if (s >= 0) close(s);
+        if (ok) { intern_unref(uid); close(fd); return; }
+        send_redirect(fd, home, room);
+        room = 0;
+    }
+    uint32_t ip = ntohl(a.sin_addr.s_addr);
+    if (ip_banned(ip) || ip_acquire(ip) < 0) { intern_unref(uid); close(fd); return; }
+    stat_add(&stat_migrated_in, 1);
+    if (room) steer_learn(ip, self_peer);
+    client_start(fd, ip, uid, is_new, room);
+}
+
+void *mig_thread(void *arg) {
+    int ls = (int)(intptr_t)arg;
+    while (1) {
+        int s = accept4(ls, NULL, NULL, SOCK_CLOEXEC), fds[2];
+        if (s < 0) { perror("shards: accept"); continue; }
+        if (!mig_trusted(s)) { close(s); continue; }
+        mig_msg_t m;
+        int nfds = fd_recv(s, &m, sizeof(m), fds);
+        if (nfds == 0 && m.kind == MIG_MAPS) {
+            int maps[2] = { steer_ips, steer_socks };
+            fd_send(s, &m, sizeof(m), maps, steer_ips >= 0 ? 2 : 0);
+        } else if (nfds == 1 && m.kind == MIG_CONN) {
+            shard_adopt(fds[0], &m);
+        } else {
+            for (int i=0;i<nfds;i++) close(fds[i]);
+        }
+        close(s);
+    }
+    return NULL;
+}
+
+// a standby: its thread owns the socket (and the per-IP slot) from here
+void pend_replica(int ep, pending_t *p) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    if (repl_start(p->fd, p->ip, p->buf + sizeof(frame_hdr_t)) < 0) { pend_drop(p); return; }
+    p->fd = -1;
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+}
+
+// another cluster node (checked against the -P list)
+void pend_peer(int ep, pending_t *p) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    if (peer_in_start(p->fd, p->ip, p->buf + sizeof(frame_hdr_t)) < 0) { pend_drop(p); return; }
+    p->fd = -1;
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+}
+
+// a relay subscribing to us (allowed by -A, like standbys)
+void pend_relay(int ep, pending_t *p) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    if (relay_in_start(p->fd, p->ip) < 0) { pend_drop(p); return; }
+    p->fd = -1;
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+}
+
+// a spectator: from here on it only ever receives
+void pend_watch(int ep, pending_t *p) {
+    char *name = p->buf + sizeof(frame_hdr_t);
+    name[ntohl(((frame_hdr_t*)p->buf)->len)] = '\0';
+    int room = room_find(name, 1);
+    if (room < 0 || mem_tier() >= TIER_REFUSE) {
+        send_to_sock(p->fd, room < 0 ? "*** invalid room name (or too many rooms)\n" : "*** server busy, try again later\n");
+        pend_drop(p);
+        return;
+    }
+    if (npeers && room != 0) {
+        int home = room_place(room);
+        if (home >= 0 && home != self_peer) { send_redirect(p->fd, home, room); pend_drop(p); return; }
+    }
+    epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+    if (spec_start(p->fd, p->ip, room) < 0) {
+        send_to_sock(p->fd, "*** server full, try again later\n");
+        pend_drop(p);
+        return;
+    }
+    p->fd = -1;
+    atomic_fetch_sub_explicit(&stat_pending, 1, memory_order_relaxed);
+}
+
+void pend_read(int ep, pending_t *p) {
+    const size_t hl = sizeof(frame_hdr_t);
+    while (1) {
+        size_t want = hl;
+        if (p->got >= hl) {
+            frame_hdr_t *h = (frame_hdr_t*)p->buf;
+            uint32_t len = ntohl(h->len);
+            int repl = h->type == F_REPL && len == 10 && repl_allowed(p->ip);
+            int peer = h->type == F_PEER && len == 2 && npeers;
+            int relay = h->type == F_RELAY && len == 2 && repl_allowed(p->ip);
+            if ((h->type != F_HELLO && h->type != F_WATCH && !repl && !peer && !relay) || len == 0 || len >= NAME_LEN) { pend_drop(p); return; }
+            want = hl + len;
+            if (p->got == want && h->type == F_WATCH) { pend_watch(ep, p); return; }
+            if (p->got == want && relay) { pend_relay(ep, p); return; }
+            if (p->got == want && repl) { pend_replica(ep, p); return; }
+            if (p->got == want && peer) { pend_peer(ep, p); return; }
+            if (p->got == want) { pend_promote(ep, p); return; }
+        }
+        ssize_t r = recv(p->fd, p->buf + p->got, want - p->got, 0);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (r <= 0) { pend_drop(p); return; }
+        p->got += r;
+    }
+}
+
+void pend_accept(int ep, int listenfd) {
+    while (1) {
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int conn = accept4(listenfd, (struct sockaddr*)&cliaddr, &clilen, SOCK_NONBLOCK);
+        if (conn < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        uint32_t ip = ntohl(cliaddr.sin_addr.s_addr);
+        // banned ranges are checked before anything else is spent on them
+        if (ip_banned(ip)) {
+            atomic_fetch_add(&ban_rejects, 1);
+            close_rst(conn);
+            continue;
+        }
+        if (ip_acquire(ip) < 0) {
+            atomic_fetch_add(&hs_dropped, 1);
+            close_rst(conn);
+            continue;
+        }
+        pending_t *p = NULL, *oldest = &pend[0];
+        for (int i=0;i<MAX_PENDING;i++) {
+            if (pend[i].fd < 0) { p = &pend[i]; break; }
+            if (pend[i].deadline < oldest->deadline) oldest = &pend[i];
+        }
+        if (!p) { pend_drop(oldest); p = oldest; }
+        atomic_fetch_add_explicit(&stat_pending, 1, memory_order_relaxed);
+        p->fd = conn;
+        p->ip = ip;
+        p->got = 0;
+        p->deadline = mono_ms() + HANDSHAKE_MS;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = p - pend };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, conn, &ev) < 0) { perror("epoll_ctl"); pend_drop(p); }
+    }
+}
+
+// listeners: ours, and the shared port's (-R) if any
+void accept_loop(int listenfd, int sharedfd) {
+    int ep = epoll_create1(0);
+    if (ep < 0) { perror("epoll_create1"); exit(1); }
+    int lfd[2] = { listenfd, sharedfd };
+    for (int i=0;i<2 && lfd[i] >= 0;i++) {
+        fcntl(lfd[i], F_SETFL, fcntl(lfd[i], F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = MAX_PENDING + i };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, lfd[i], &ev) < 0) { perror("epoll_ctl"); exit(1); }
+    }
+    for (int i=0;i<MAX_PENDING;i++) pend[i].fd = -1;
+    struct epoll_event evs[64];
+    while (1) {
+        int n = epoll_wait(ep, evs, 64, 250);
+        for (int i=0;i<n;i++) {
+            uint32_t k = evs[i].data.u32;
+            if (k >= MAX_PENDING) pend_accept(ep, lfd[k - MAX_PENDING]);
+            else if (pend[k].fd >= 0) pend_read(ep, &pend[k]);
+        }
+        uint64_t now = mono_ms();
+        for (int i=0;i<MAX_PENDING;i++) {
+            if (pend[i].fd >= 0 && pend[i].deadline <= now) pend_drop(&pend[i]);
+        }
+    }
+}
+
+/*
+ * Dashboard (-d). Redraws once per DASH_MS from the stats counters alone:
+ * no clients_mutex, no hot-path lock, and SCHED_IDLE so it only gets CPU
+ * nobody else wants. Rates are deltas between two passes. The admin console
+ * shares the terminal, so the page is drawn over its top lines only and the
+ * rest is made a scroll region: commands, their replies and the log lines
+ * scroll there, and each redraw saves and restores the cursor, so a line
+ * being typed stays put. Not on a terminal, the page is just appended.
+ */
+// upper bound (us) of the bucket holding the q-th fraction of n samples
+unsigned long dash_pct(const unsigned long *h, unsigned long n, double q) {
+    unsigned long want = (unsigned long)(q * n), seen = 0;
+    for (int b=0;b<LAT_BUCKETS;b++) {
+        seen += h[b];
+        if (seen > want) return 1ul << b;
+    }
+    return 1ul << (LAT_BUCKETS-1);
+}
+
+// the top of the terminal was ours: give the whole screen back on the way out
+void dash_restore(int sig) {
+    const char reset[] = "\0337\033[r\0338";
+    if (write(STDOUT_FILENO, reset, sizeof(reset) - 1) < 0) {}
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// page into the top lines, a rule under it, scroll region below; *height is
+// what the last call used (0 = first)
+void dash_draw(const char *page, size_t n, int *height, int *rows) {
+    struct winsize ws;
+    int ok = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col;
+    int r = ok ? ws.ws_row : 24, cols = ok ? ws.ws_col : 80, lines = 0;
+    for (size_t i=0;i<n;i++) lines += page[i] == '\n';
+    // keep at least two rows for the console
+    if (lines > r - 3) lines = r - 3;
+    char out[8192];
+    size_t o = 0;
+    #define O(...) o += snprintf(out + o, o < sizeof(out) ? sizeof(out) - o : 0, __VA_ARGS__)
+    if (!*height) O("\033[2J\033[%d;1H", r);     // the console starts at the bottom
+    O("\0337");
+    // setting the region homes the cursor: it is saved already
+    if (lines + 1 != *height || r != *rows) O("\033[%d;%dr", lines + 2, r);
+    O("\033[H");
+    const char *p = page;
+    for (int i=0;i<lines;i++) {
+        const char *nl = memchr(p, '\n', page + n - p);
+        // clipped: a wrapped line would push the page into the region
+        O("%.*s\033[K\n", nl - p < cols ? (int)(nl - p) : cols, p);
+        p = nl + 1;
+    }
+    O("%.*s\033[K", cols < 80 ? cols : 80,
+      "--------------------------------------------------------------------------------");
+    // a shorter page leaves old lines behind, now at the top of the region
+    for (int i=lines+1;i<*height;i++) O("\n\033[K");
+    O("\0338");
+    #undef O
+    *height = lines + 1;
+    *rows = r;
+    if (o > sizeof(out)) o = sizeof(out);
+    fwrite(out, 1, o, stdout);
+    fflush(stdout);
+}
+
+void *dash_thread(void *arg) {
+    (void)arg;
+    int tty = isatty(STDOUT_FILENO), height = 0, rows = 0;
+    if (tty) {
+        signal(SIGINT, dash_restore);
+        signal(SIGTERM, dash_restore);
+    }
+    struct sched_param sp = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+    unsigned long lat_prev[LAT_BUCKETS] = { 0 };
+    unsigned long msgs_prev = 0, in_prev = 0, out_prev = 0;
+    uint64_t last = mono_ms();
+    struct timespec ts = { DASH_MS / 1000, (DASH_MS % 1000) * 1000000L };
+    while (1) {
+        nanosleep(&ts, NULL);
+        uint64_t now = mono_ms();
+        double secs = (now - last) / 1000.0;
+        last = now;
+        if (secs <= 0) secs = 1;
+
+        unsigned long msgs = atomic_load(&stat_msgs), in = atomic_load(&stat_bytes_in), out = atomic_load(&stat_bytes_out);
+        // last finished heavy-hitter window; the hot path never takes this lock
+        ss_entry_t rooms[DASH_TOP], talkers[DASH_TOP];
+        pthread_mutex_lock(&hh_snap_mutex);
+        int nr = snap_nrooms < DASH_TOP ? snap_nrooms : DASH_TOP;
+        int nt = snap_ntalkers < DASH_TOP ? snap_ntalkers : DASH_TOP;
+        memcpy(rooms, snap_rooms, nr * sizeof(rooms[0]));
+        memcpy(talkers, snap_talkers, nt * sizeof(talkers[0]));
+        pthread_mutex_unlock(&hh_snap_mutex);
+        unsigned long lat[LAT_BUCKETS], nlat = 0;
+        for (int b=0;b<LAT_BUCKETS;b++) {
+            unsigned long v = atomic_load_explicit(&lat_hist[b], memory_order_relaxed);
+            lat[b] = v - lat_prev[b];
+            lat_prev[b] = v;
+            nlat += lat[b];
+        }
+
+        char page[4096];
+        size_t n = 0;
+        #define P(...) n += snprintf(page + n, n < sizeof(page) ? sizeof(page) - n : 0, __VA_ARGS__)
+        P("-- chat server --\n\n");
+        P("connections  %d online, %d spectating, %d in handshake, %lu dropped at handshake, %lu banned at accept\n",
+          atomic_load(&stat_clients), atomic_load(&stat_spectators), atomic_load(&stat_pending),
+          atomic_load(&hs_dropped), atomic_load(&ban_rejects));
+        P("traffic      %.0f msgs/s, in %.1f KB/s, out %.1f KB/s, %lu rate-limited\n",
+          (msgs - msgs_prev) / secs, (in - in_prev) / secs / 1024, (out - out_prev) / secs / 1024,
+          atomic_load(&stat_limited));
+        P("queues       log buffer %zu B, presence events %d, unacked frames %d\n",
+          atomic_load(&stat_logbuf), atomic_load(&stat_presence), atomic_load(&stat_unacked));
+        pthread_mutex_lock(&repl_mutex);
+        off_t lend = log_off;   // racy read, fine for a gauge
+        int nrep = 0;
+        long long lag = 0;
+        for (int i=0;i<MAX_REPLICAS;i++) {
+            if (!replicas[i]) continue;
+            long long l = lend - atomic_load(&replicas[i]->synced);
+            if (l > lag) lag = l;
+            nrep++;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+        if (nrep) P("replication  %d standby(s), worst lag %lld B\n", nrep, lag);
+        if (up_port || nrelay_fds) {
+            P("relay        depth %d, upstream %s, %d relay(s) below\n", relay_depth,
+              !up_port ? "none (origin)" : upstream_fd >= 0 ? "up" : "down", nrelay_fds);
+        }
+        if (mc_fd >= 0) {
+            P("multicast    %s:%d, %d client(s) listening, %lu datagrams, %lu repaired\n", inet_ntoa(mc_addr.sin_addr),
+              ntohs(mc_addr.sin_port), atomic_load(&stat_mcast), atomic_load(&stat_mc_sent), atomic_load(&stat_mc_repaired));
+        }
+        if (ll_ncpus) {
+            P("low latency  %d of %d spin cores busy, %lu claims\n", ll_spinning(), ll_ncpus, atomic_load(&stat_ll_claims));
+        }
+        if (shard_port) {
+            P("shards       port %d, %s, %lu clients moved out, %lu in, %lu addresses learned\n", shard_port,
+              steer_ips >= 0 ? "eBPF steering" : "no steering", atomic_load(&stat_migrated_out),
+              atomic_load(&stat_migrated_in), atomic_load(&stat_steer_learned));
+        }
+        if (npeers) {
+            P("cluster      node %d of %d, %lu redirects; rooms:", self_peer + 1, npeers, atomic_load(&stat_redirects));
+            for (int i=0;i<npeers;i++) P(" %s%d", peer_up(i) ? "" : "down:", peer_load(i));
+            P("\n");
+        }
+        P("memory       tier %s;", tier_name[atomic_load(&mem_cur_tier)]);
+        for (int c=0;c<MEM_NCAT;c++) P(" %s %.1f MB", mem_cat_name[c], atomic_load(&mem_used[c]) / 1048576.0);
+        P("\n");
+        P("buffers      %.0f MB in %lu hugetlb + %lu THP-advised + %lu 4K arenas, %lu kB on THP; in use:",
+          atomic_load(&pool_reserved) / 1048576.0, atomic_load(&arena_count[ARENA_HUGETLB]),
+          atomic_load(&arena_count[ARENA_THP]), atomic_load(&arena_count[ARENA_4K]), thp_kb());
+        for (int c=0;c<NCLASSES;c++) P(" %uB %lu", class_size[c], atomic_load(&pool_used[c]));
+        P("\n");
+        if (nlat) {
+            P("fan-out      p50 <%luus p90 <%luus p99 <%luus (%lu msgs)\n",
+              dash_pct(lat, nlat, 0.5), dash_pct(lat, nlat, 0.9), dash_pct(lat, nlat, 0.99), nlat);
+        } else {
+            P("fan-out      idle\n");
+        }
+        P("\ntop rooms (msgs/s)          top talkers (msgs/s, last %ds)\n", HH_WINDOW_MS / 1000);
+        for (int i=0;i<nr || i<nt;i++) {
+            char rl[48] = "", tl[48] = "";
+            if (i < nr) snprintf(rl, sizeof(rl), "#%s %.1f", room_names[rooms[i].key], rooms[i].count * 1000.0 / HH_WINDOW_MS);
+            if (i < nt) snprintf(tl, sizeof(tl), "%s %.1f", uid_name(talkers[i].key), talkers[i].count * 1000.0 / HH_WINDOW_MS);
+            P("  %-26s %s\n", rl, tl);
+        }
+        #undef P
+        if (n > sizeof(page)) n = sizeof(page);
+        if (tty) {
+            dash_draw(page, n, &height, &rows);
+        } else {
+            fwrite(page, 1, n, stdout);
+            fputc('\n', stdout);
+            fflush(stdout);
+        }
+        msgs_prev = msgs; in_prev = in; out_prev = out;
+    }
     return NULL;
 }
 
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <port> [-m budget_mb] [-c cache_mb] [-B banfile] [-i max_per_ip] [-d] [-r msgs_per_sec] [-D]\n"
+                    "       [-A replica_cidr] [-F primary_ip:port] [-P ip:port,ip:port,...] [-U upstream_ip:port]\n"
+                    "       [-M group:port[,ifaddr]] [-R shared_port] [-L|--low-latency cpus] [-H]\n", prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]); exit(1);
+    int c;
+    const char *banfile = NULL, *follow = NULL, *cluster = NULL;
+    int dashboard = 0;
+    static const struct option longopts[] = {
+        { "low-latency", required_argument, NULL, 'L' },
+        { NULL, 0, NULL, 0 },
+    };
+    while ((c = getopt_long(argc, argv, "m:c:B:i:dr:DA:F:P:U:M:R:L:H", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'm': mem_budget = (size_t)atol(optarg) << 20; break;
+        case 'c': cache_budget = (size_t)atol(optarg) << 20; break;
+        case 'B': banfile = optarg; break;
+        case 'i': max_per_ip = atoi(optarg); break;
+        case 'd': dashboard = 1; break;
+        case 'r': rate_limit = atoi(optarg); break;
+        case 'D': durable = 1; break;
+        case 'A': if (parse_cidr(optarg, &repl_net, &repl_plen) < 0) usage(argv[0]); break;
+        case 'F': follow = optarg; break;
+        case 'P': cluster = optarg; break;
+        case 'M': mc_open(optarg); break;
+        case 'R': shard_port = atoi(optarg); break;
+        case 'L': ll_parse(optarg); break;
+        case 'H': huge_pages = 1; arena_size = HUGE_PAGE; break;
+        case 'U': if (sscanf(optarg, "%47[^:]:%d", up_host, &up_port) != 2) usage(argv[0]); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 || mem_budget == 0) usage(argv[0]);
+    int port = atoi(argv[optind]);
+    if (ll_ncpus) ll_init();
+    if (cluster && cluster_init(cluster, port) < 0) {
+        fprintf(stderr, "-P: need ip:port entries, one of them with port %d\n", port);
+        exit(1);
     }
-    int port = atoi(argv[1]);
+    if (shard_port && !npeers) {
+        fprintf(stderr, "-R: shards are the nodes of a -P cluster on this host\n");
+        exit(1);
+    }
+    if (follow) {
+        char host[64];
+        int pport;
+        if (sscanf(follow, "%63[^:]:%d", host, &pport) != 2) usage(argv[0]);
+        repl_follow(host, pport, port);
+    }
+    intern_init();
+    log_open();
+    atomic_store(&hh_start, mono_ms());
+    if (banfile) load_bans(banfile);
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listenfd < 0) { perror("socket"); exit(1); }
     int opt = 1;
@@ -186,24 +4202,67 @@ int main(int argc, char **argv) {
     struct sockaddr_in serv;
     serv.sin_family = AF_INET; serv.sin_addr.s_addr = INADDR_ANY; serv.sin_port = htons(port);
     if (bind(listenfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind"); exit(1); }
-    if (listen(listenfd, 10) < 0) { perror("listen"); exit(1); }
+    int defer = HANDSHAKE_MS / 1000;
+    setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    if (listen(listenfd, SOMAXCONN) < 0) { perror("listen"); exit(1); }
+    if (shard_port) {
+        shard_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (shard_fd < 0) { perror("socket"); exit(1); }
+        setsockopt(shard_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(shard_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        serv.sin_port = htons(shard_port);
+        if (bind(shard_fd, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind -R"); exit(1); }
+        setsockopt(shard_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+        if (listen(shard_fd, SOMAXCONN) < 0) { perror("listen -R"); exit(1); }
+        steer_init();
+        struct sockaddr_un ua;
+        socklen_t ulen = mig_addr(&ua, port);
+        int ms = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (ms < 0 || bind(ms, (struct sockaddr*)&ua, ulen) < 0 || listen(ms, 64) < 0) { perror("shards: migration socket"); exit(1); }
+        pthread_t mtid;
+        pthread_create(&mtid, NULL, &mig_thread, (void*)(intptr_t)ms);
+        pthread_detach(mtid);
+    }
+    // spectators are cheap enough that descriptors run out first
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
     printf("Server listening on port %d\n", port);
-    // clear log
-    FILE *f = fopen(LOGFILE, "a"); if (f) fclose(f);
-
-    while (1) {
-        struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
-        int conn = accept(listenfd, (struct sockaddr*)&cliaddr, &clilen);
-        if (conn < 0) { perror("accept"); continue; }
-        client_t *cli = (client_t*)malloc(sizeof(client_t));
-        cli->sock = conn;
-        cli->name[0] = '\0';
-        add_client(cli);
-        pthread_t tid;
-        pthread_create(&tid, NULL, &handle_client, (void*)cli);
-        pthread_detach(tid);
+    mem_register_shrinker(hist_shrink);
+    mem_register_shrinker(session_shrink);
+    pthread_t ttid;
+    pthread_create(&ttid, NULL, &tick_thread, NULL);
+    pthread_detach(ttid);
+    pthread_create(&ttid, NULL, &console_thread, NULL);
+    pthread_detach(ttid);
+    if ((spec_ep = epoll_create1(0)) < 0) { perror("epoll_create1"); exit(1); }
+    pthread_create(&ttid, NULL, &spec_thread, NULL);
+    pthread_detach(ttid);
+    if (dashboard) {
+        pthread_create(&ttid, NULL, &dash_thread, NULL);
+        pthread_detach(ttid);
     }
+    if (up_port) {
+        pthread_create(&ttid, NULL, &upstream_thread, (void*)(intptr_t)port);
+        pthread_detach(ttid);
+    }
+    for (int i=0;i<npeers;i++) {
+        if (i == self_peer) continue;
+        pthread_create(&ttid, NULL, &peer_out_thread, &peers[i]);
+        pthread_detach(ttid);
+    }
+    if (durable) {
+        // everything before now counts as committed once this sync returns
+        log_flush();
+        if (fdatasync(log_fd) < 0) perror("fdatasync " LOGFILE);
+        log_synced = log_end();
+        pthread_create(&ttid, NULL, &log_commit_thread, NULL);
+        pthread_detach(ttid);
+    }
+
+    accept_loop(listenfd, shard_fd);
     close(listenfd);
     return 0;
 }
@@ -1,6 +1,6 @@
 #!/bin/bash
-# Usage: ./start_tmux_client.sh <server-ip> <port> <username>
+# Usage: ./start_tmux_client.sh <server-ip> <port> <username> [<server-ip>:<port> ...]
 SESSION="chat-client-$3"
 tmux new-session -d -s $SESSION
-tmux send-keys -t $SESSION "./client $1 $2 $3" C-m
+tmux send-keys -t $SESSION "./client $*" C-m
 tmux attach -t $SESSION
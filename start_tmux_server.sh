@@ -1,6 +1,6 @@
 #!/bin/bash
-# Usage: ./start_tmux_server.sh <port>
+# Usage: ./start_tmux_server.sh <port> [server options, e.g. -d for the dashboard]
 SESSION="chat-server-$1"
 tmux new-session -d -s $SESSION
-tmux send-keys -t $SESSION "./server $1" C-m
+tmux send-keys -t $SESSION "./server $*" C-m
 tmux attach -t $SESSION